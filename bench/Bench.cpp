@@ -0,0 +1,426 @@
+/*****************************************************************************
+ * Bench.cpp: Compares the ORM against raw sqlite3 calls
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "sqlite/sqlite.hpp"
+#include "sqlite/Table.hpp"
+
+// Counts the heap allocations made by the measured code. SQLite's own
+// allocations don't go through operator new, and are left out.
+static std::atomic<uint64_t> nbAllocations( 0 );
+
+// Not inlined, so the compiler doesn't pair the malloc/free calls with the
+// new/delete expressions and warn about mismatched allocation functions.
+__attribute__((noinline)) static void* allocate( size_t size )
+{
+    return std::malloc( size );
+}
+
+__attribute__((noinline)) static void release( void* ptr )
+{
+    std::free( ptr );
+}
+
+void* operator new( size_t size )
+{
+    ++nbAllocations;
+    void* ptr = allocate( size );
+    if ( ptr == NULL )
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void operator delete( void* ptr ) noexcept
+{
+    release( ptr );
+}
+
+void operator delete( void* ptr, size_t ) noexcept
+{
+    release( ptr );
+}
+
+class Artist : public vsqlite::Table<Artist>
+{
+    public:
+        static const vsqlite::TableSchema<Artist>* schema;
+
+        ColumnAttribute<int64_t> id;
+        ColumnAttribute<std::string> name;
+};
+
+const vsqlite::TableSchema<Artist>* Artist::schema = Artist::Register("Artist",
+                                          createPrimaryKey(&Artist::id, "id"),
+                                          createField(&Artist::name, "name"));
+
+class Track : public vsqlite::Table<Track>
+{
+    public:
+        static const vsqlite::TableSchema<Track>* schema;
+
+        ColumnAttribute<int64_t> id;
+        ColumnAttribute<std::string> title;
+        ColumnAttribute<double> duration;
+        ForeignKeyAttribute<Artist, int64_t> artist;
+};
+
+const vsqlite::TableSchema<Track>* Track::schema = Track::Register("Track",
+                                          createPrimaryKey(&Track::id, "id"),
+                                          createField(&Track::title, "title"),
+                                          createField(&Track::duration, "duration"),
+                                          createForeignKey(&Track::artist, "artist"),
+                                          createIndex(&Track::title));
+
+// Plain struct filled by the raw sqlite3 baselines
+struct RawTrack
+{
+    int64_t id;
+    std::string title;
+    double duration;
+    int64_t artist;
+    std::string artistName;
+};
+
+struct Measure
+{
+    double seconds;
+    uint64_t nbAllocations;
+};
+
+template <typename F>
+static Measure measure( F f )
+{
+    uint64_t allocations = nbAllocations;
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+    return Measure{ duration.count(), nbAllocations - allocations };
+}
+
+static void report( const char* scenario, size_t nbOperations, const Measure& orm, const Measure& raw )
+{
+    printf( "%-18s %12.0f ops/s %8.2f allocs/op | raw %12.0f ops/s %8.2f allocs/op | x%.2f\n",
+            scenario,
+            nbOperations / orm.seconds, (double)orm.nbAllocations / nbOperations,
+            nbOperations / raw.seconds, (double)raw.nbAllocations / nbOperations,
+            orm.seconds / raw.seconds );
+}
+
+static void check( int resultCode, int expected, sqlite3* db )
+{
+    if ( resultCode == expected )
+        return;
+    fprintf( stderr, "Unexpected SQLite result %d: %s\n", resultCode, sqlite3_errmsg( db ) );
+    exit( 1 );
+}
+
+static void execute( sqlite3* db, const char* request )
+{
+    check( sqlite3_exec( db, request, NULL, NULL, NULL ), SQLITE_OK, db );
+}
+
+static sqlite3_stmt* prepare( sqlite3* db, const char* request )
+{
+    sqlite3_stmt* stmt;
+    check( sqlite3_prepare_v2( db, request, -1, &stmt, NULL ), SQLITE_OK, db );
+    return stmt;
+}
+
+static void clearTables( sqlite3* db )
+{
+    // Identity maps would otherwise hand out rows which don't exist anymore
+    Track::remove().execute( db );
+    Artist::remove().execute( db );
+    execute( db, "DELETE FROM sqlite_sequence" );
+}
+
+// Longer than the small string buffer, so string copies show up in the
+// allocation counts
+static std::string title( size_t i )
+{
+    return "Track #" + std::to_string( i ) + " from the benchmark album";
+}
+
+static std::vector<Track> makeTracks( size_t nbRows )
+{
+    std::vector<Track> tracks( nbRows );
+    for ( size_t i = 0; i < nbRows; ++i )
+    {
+        tracks[i].title = title( i );
+        tracks[i].duration = 180.0 + i % 120;
+    }
+    return tracks;
+}
+
+static void rawInsert( sqlite3* db, sqlite3_stmt* stmt, size_t i, int64_t artist )
+{
+    auto t = title( i );
+    sqlite3_bind_null( stmt, 1 );
+    sqlite3_bind_text( stmt, 2, t.c_str(), t.size(), SQLITE_STATIC );
+    sqlite3_bind_double( stmt, 3, 180.0 + i % 120 );
+    if ( artist > 0 )
+        sqlite3_bind_int64( stmt, 4, artist );
+    else
+        sqlite3_bind_null( stmt, 4 );
+    check( sqlite3_step( stmt ), SQLITE_DONE, db );
+    sqlite3_reset( stmt );
+}
+
+static void singleInsert( sqlite3* db, size_t nbRows )
+{
+    clearTables( db );
+    auto tracks = makeTracks( nbRows );
+    auto orm = measure( [&tracks]() {
+        for ( auto& t : tracks )
+            t.insert().execute( vsqlite::DBConnection::instance().rawConnection() );
+    } );
+    clearTables( db );
+    auto raw = measure( [db, nbRows]() {
+        auto stmt = prepare( db, "INSERT INTO Track VALUES(?,?,?,?)" );
+        for ( size_t i = 0; i < nbRows; ++i )
+            rawInsert( db, stmt, i, 0 );
+        sqlite3_finalize( stmt );
+    } );
+    report( "single insert", nbRows, orm, raw );
+}
+
+static void bulkInsert( sqlite3* db, size_t nbRows )
+{
+    clearTables( db );
+    auto tracks = makeTracks( nbRows );
+    auto orm = measure( [&tracks]() {
+        Track::insert( tracks ).execute( vsqlite::DBConnection::instance().rawConnection() );
+    } );
+    clearTables( db );
+    auto raw = measure( [db, nbRows]() {
+        execute( db, "BEGIN" );
+        auto stmt = prepare( db, "INSERT INTO Track VALUES(?,?,?,?)" );
+        for ( size_t i = 0; i < nbRows; ++i )
+            rawInsert( db, stmt, i, 0 );
+        sqlite3_finalize( stmt );
+        execute( db, "COMMIT" );
+    } );
+    report( "bulk insert", nbRows, orm, raw );
+}
+
+// Fills the tables used by the read scenarios: nbRows tracks spread over
+// 1 artist out of 10 rows.
+static void populate( sqlite3* db, size_t nbRows )
+{
+    clearTables( db );
+    execute( db, "BEGIN" );
+    auto stmt = prepare( db, "INSERT INTO Artist VALUES(NULL, ?)" );
+    size_t nbArtists = nbRows / 10 + 1;
+    for ( size_t i = 0; i < nbArtists; ++i )
+    {
+        auto name = "Artist #" + std::to_string( i ) + " of the benchmark";
+        sqlite3_bind_text( stmt, 1, name.c_str(), name.size(), SQLITE_STATIC );
+        check( sqlite3_step( stmt ), SQLITE_DONE, db );
+        sqlite3_reset( stmt );
+    }
+    sqlite3_finalize( stmt );
+    stmt = prepare( db, "INSERT INTO Track VALUES(?,?,?,?)" );
+    for ( size_t i = 0; i < nbRows; ++i )
+        rawInsert( db, stmt, i, i % nbArtists + 1 );
+    sqlite3_finalize( stmt );
+    execute( db, "COMMIT" );
+}
+
+static void fullScan( sqlite3* db, size_t nbRows )
+{
+    size_t nbLoaded = 0;
+    auto orm = measure( [&nbLoaded]() {
+        std::vector<Track> tracks = Track::fetch();
+        nbLoaded = tracks.size();
+    } );
+    auto raw = measure( [db, &nbLoaded]() {
+        std::vector<RawTrack> tracks;
+        auto stmt = prepare( db, "SELECT * FROM Track" );
+        while ( sqlite3_step( stmt ) == SQLITE_ROW )
+        {
+            RawTrack t;
+            t.id = sqlite3_column_int64( stmt, 0 );
+            t.title.assign( (const char*)sqlite3_column_text( stmt, 1 ), sqlite3_column_bytes( stmt, 1 ) );
+            t.duration = sqlite3_column_double( stmt, 2 );
+            t.artist = sqlite3_column_int64( stmt, 3 );
+            tracks.push_back( std::move( t ) );
+        }
+        sqlite3_finalize( stmt );
+        nbLoaded -= tracks.size();
+    } );
+    if ( nbLoaded != 0 )
+        fprintf( stderr, "full scan: the ORM and the baseline loaded different rows\n" );
+    report( "full scan", nbRows, orm, raw );
+}
+
+static std::vector<int64_t> randomKeys( size_t nbRows, size_t nbLookups )
+{
+    std::mt19937 generator( 42 );
+    std::uniform_int_distribution<int64_t> distribution( 1, nbRows );
+    std::vector<int64_t> keys( nbLookups );
+    for ( auto& k : keys )
+        k = distribution( generator );
+    return keys;
+}
+
+static void primaryKeyLookup( sqlite3* db, size_t nbRows, size_t nbLookups )
+{
+    auto keys = randomKeys( nbRows, nbLookups );
+    auto orm = measure( [&keys]() {
+        for ( auto k : keys )
+        {
+            Track t = Track::fetch().where( Track::primaryKey() == k );
+            (void)t;
+        }
+    } );
+    auto raw = measure( [db, &keys]() {
+        auto stmt = prepare( db, "SELECT * FROM Track WHERE id = ?" );
+        for ( auto k : keys )
+        {
+            sqlite3_bind_int64( stmt, 1, k );
+            check( sqlite3_step( stmt ), SQLITE_ROW, db );
+            RawTrack t;
+            t.id = sqlite3_column_int64( stmt, 0 );
+            t.title.assign( (const char*)sqlite3_column_text( stmt, 1 ), sqlite3_column_bytes( stmt, 1 ) );
+            t.duration = sqlite3_column_double( stmt, 2 );
+            t.artist = sqlite3_column_int64( stmt, 3 );
+            sqlite3_reset( stmt );
+        }
+        sqlite3_finalize( stmt );
+    } );
+    report( "pk lookup", nbLookups, orm, raw );
+}
+
+static void indexedLookup( sqlite3* db, size_t nbRows, size_t nbLookups )
+{
+    auto keys = randomKeys( nbRows, nbLookups );
+    std::vector<std::string> titles;
+    for ( auto k : keys )
+        titles.push_back( title( k - 1 ) );
+    auto titleColumn = Track::schema->column( "title" );
+    auto orm = measure( [&titles, &titleColumn]() {
+        for ( const auto& t : titles )
+        {
+            Track track = Track::fetch().where( *titleColumn == t );
+            (void)track;
+        }
+    } );
+    auto raw = measure( [db, &titles]() {
+        auto stmt = prepare( db, "SELECT * FROM Track WHERE title = ?" );
+        for ( const auto& title : titles )
+        {
+            sqlite3_bind_text( stmt, 1, title.c_str(), title.size(), SQLITE_STATIC );
+            check( sqlite3_step( stmt ), SQLITE_ROW, db );
+            RawTrack t;
+            t.id = sqlite3_column_int64( stmt, 0 );
+            t.title.assign( (const char*)sqlite3_column_text( stmt, 1 ), sqlite3_column_bytes( stmt, 1 ) );
+            t.duration = sqlite3_column_double( stmt, 2 );
+            t.artist = sqlite3_column_int64( stmt, 3 );
+            sqlite3_reset( stmt );
+        }
+        sqlite3_finalize( stmt );
+    } );
+    report( "indexed lookup", nbLookups, orm, raw );
+}
+
+static void foreignKeyListing( sqlite3* db, size_t nbRows )
+{
+    size_t nameLengths = 0;
+    auto orm = measure( [&nameLengths]() {
+        std::vector<Track> tracks = Track::fetch().with( &Track::artist );
+        for ( auto& t : tracks )
+            nameLengths += ( (const std::string&)t.artist->name ).size();
+    } );
+    auto raw = measure( [db, &nameLengths]() {
+        std::vector<RawTrack> tracks;
+        auto stmt = prepare( db, "SELECT t.id, t.title, t.duration, t.artist, a.name FROM Track t "
+                                 "LEFT JOIN Artist a ON a.id = t.artist" );
+        while ( sqlite3_step( stmt ) == SQLITE_ROW )
+        {
+            RawTrack t;
+            t.id = sqlite3_column_int64( stmt, 0 );
+            t.title.assign( (const char*)sqlite3_column_text( stmt, 1 ), sqlite3_column_bytes( stmt, 1 ) );
+            t.duration = sqlite3_column_double( stmt, 2 );
+            t.artist = sqlite3_column_int64( stmt, 3 );
+            t.artistName.assign( (const char*)sqlite3_column_text( stmt, 4 ), sqlite3_column_bytes( stmt, 4 ) );
+            tracks.push_back( std::move( t ) );
+        }
+        sqlite3_finalize( stmt );
+        for ( const auto& t : tracks )
+            nameLengths -= t.artistName.size();
+    } );
+    if ( nameLengths != 0 )
+        fprintf( stderr, "fk listing: the ORM and the baseline loaded different rows\n" );
+    report( "fk listing", nbRows, orm, raw );
+}
+
+int main( int argc, char** argv )
+{
+    std::string profile = argc > 3 ? argv[3] : "bulkload";
+    vsqlite::ConnectionOptions options;
+    if ( profile == "readheavy" )
+        options = vsqlite::ConnectionOptions::readHeavy();
+    else if ( profile == "bulkload" )
+        options = vsqlite::ConnectionOptions::bulkLoad();
+    else if ( profile == "durable" )
+        options = vsqlite::ConnectionOptions::durable();
+    else if ( profile != "default" )
+        argc = 0;
+    if ( argc > 4 || argc == 0 )
+    {
+        fprintf( stderr, "usage: %s [nbRows [nbLookups [default|readheavy|bulkload|durable]]]\n", argv[0] );
+        return 1;
+    }
+    size_t nbRows = argc > 1 ? strtoul( argv[1], NULL, 10 ) : 10000;
+    size_t nbLookups = argc > 2 ? strtoul( argv[2], NULL, 10 ) : nbRows;
+    if ( nbRows == 0 )
+        nbRows = 1;
+
+    const char* path = "bench.db";
+    remove( path );
+    if ( vsqlite::DBConnection::init( path, options ) == false )
+        return 1;
+    sqlite3* db = vsqlite::DBConnection::instance().rawConnection();
+
+    printf( "%zu rows, %zu lookups, %s profile\n", nbRows, nbLookups, profile.c_str() );
+    singleInsert( db, nbRows );
+    bulkInsert( db, nbRows );
+    populate( db, nbRows );
+    fullScan( db, nbRows );
+    primaryKeyLookup( db, nbRows, nbLookups );
+    indexedLookup( db, nbRows, nbLookups );
+    foreignKeyListing( db, nbRows );
+
+    vsqlite::DBConnection::close();
+    remove( path );
+    remove( "bench.db-wal" );
+    remove( "bench.db-shm" );
+    return 0;
+}
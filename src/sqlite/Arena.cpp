@@ -0,0 +1,71 @@
+/*****************************************************************************
+ * Arena.cpp: Bump allocator for fetched values
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include "Arena.hpp"
+
+#include <cstring>
+
+using namespace vsqlite;
+
+constexpr size_t Arena::DefaultChunkSize;
+
+Arena::Arena( size_t chunkSize )
+    : m_chunkSize( chunkSize )
+    , m_current( NULL )
+    , m_left( 0 )
+{
+}
+
+char*
+Arena::allocate( size_t size )
+{
+    if ( size > m_left )
+    {
+        size_t chunkSize = size > m_chunkSize ? size : m_chunkSize;
+        m_chunks.push_back( Chunk{ std::unique_ptr<char[]>( new char[chunkSize] ), chunkSize } );
+        m_current = m_chunks.back().data.get();
+        m_left = chunkSize;
+    }
+    char* res = m_current;
+    m_current += size;
+    m_left -= size;
+    return res;
+}
+
+const char*
+Arena::copy( const void* data, size_t size )
+{
+    char* res = allocate( size + 1 );
+    memcpy( res, data, size );
+    res[size] = 0;
+    return res;
+}
+
+void
+Arena::clear()
+{
+    if ( m_chunks.empty() )
+        return;
+    m_chunks.resize( 1 );
+    m_current = m_chunks[0].data.get();
+    m_left = m_chunks[0].size;
+}
@@ -0,0 +1,70 @@
+/*****************************************************************************
+ * Arena.hpp: Bump allocator for fetched values
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace vsqlite
+{
+
+/*
+ * Hands out memory from large chunks, which are only released all at once
+ * when the arena gets cleared or destroyed.
+ */
+class Arena
+{
+    public:
+        static constexpr size_t DefaultChunkSize = 16 * 1024;
+
+        Arena( size_t chunkSize = DefaultChunkSize );
+
+        Arena( const Arena& ) = delete;
+        Arena& operator=( const Arena& ) = delete;
+
+        char* allocate( size_t size );
+        // Copies size bytes in the arena, and appends a terminating '\0'
+        const char* copy( const void* data, size_t size );
+        // Releases every allocation at once. The first chunk is kept for reuse.
+        void clear();
+
+        size_t nbChunks() const { return m_chunks.size(); }
+
+    private:
+        struct Chunk
+        {
+            std::unique_ptr<char[]> data;
+            size_t size;
+        };
+
+        std::vector<Chunk> m_chunks;
+        size_t m_chunkSize;
+        char* m_current;
+        size_t m_left;
+};
+
+}
+
+#endif // ARENA_HPP
@@ -23,16 +23,26 @@
 #ifndef COLUMN_HPP
 #define COLUMN_HPP
 
-#include <cstring>
-#include <sstream>
-
+#include <algorithm>
+#include <cassert>
+#include <initializer_list>
+#include <map>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "DBConnection.hpp"
+#include "TextView.hpp"
 #include "Tools.hpp"
 #include "WhereClause.hpp"
 
 namespace vsqlite
 {
 
-template <typename T, typename U>
+template <typename T>
+class ColumnSchema;
+
+template <typename CLASS, typename TYPE, typename BASE = ColumnSchema<CLASS>>
 class ColumnSchemaImpl;
 
 template <typename>
@@ -49,15 +59,27 @@ template <typename CLASS, typename TYPE>
 class Column
 {
     public:
+        Column() = default;
+        // Declared along with the copy assignment below, which would
+        // otherwise deprecate the implicit one
+        Column( const Column& ) = default;
+
         bool isNull() const
         {
             return m_isNull;
         }
 
+        // Whether the value was modified since it was loaded or saved
+        bool isDirty() const
+        {
+            return m_isDirty;
+        }
+
         TYPE& operator=( const TYPE& value )
         {
             m_value = value;
             m_isNull = false;
+            m_isDirty = true;
             return m_value;
         }
 
@@ -65,6 +87,7 @@ class Column
         {
             m_value = std::move( value );
             m_isNull = false;
+            m_isDirty = true;
             return m_value;
         }
 
@@ -72,6 +95,7 @@ class Column
         {
             m_value = value.m_value;
             m_isNull = value.m_isNull;
+            m_isDirty = value.m_isDirty;
             return m_value;
         }
 
@@ -93,11 +117,16 @@ class Column
         }
 
     private:
+        // Columns are embedded in every row: don't make them any larger than
+        // the value they hold.
         TYPE    m_value;
         bool m_isNull = true;
-        ColumnSchemaImpl<CLASS, TYPE>* m_columnSchema;
+        bool m_isDirty = false;
 
-        friend class ColumnSchemaImpl<CLASS, TYPE>;
+        template <typename, typename, typename>
+        friend class ColumnSchemaImpl;
+        template <typename, typename, typename>
+        friend class ForeignKeySchema;
 };
 
 template <typename CLASS, typename FOREIGNVALUETYPE, typename FOREIGNKEYTYPE>
@@ -112,34 +141,103 @@ class ForeignKey
         {
             return m_foreignKey;
         }
-        FOREIGNVALUETYPE& operator=( const FOREIGNVALUETYPE& value )
+        const FOREIGNVALUETYPE& operator=( const FOREIGNVALUETYPE& value )
         {
-            const auto& fKeyImpl = static_cast<const PrimaryKeySchema<FOREIGNVALUETYPE>&>( FOREIGNVALUETYPE::schema->primaryKey() );
-            m_foreignKey = fKeyImpl.load( value );
-            m_value = value;
-            return m_value;
+            m_foreignKey = (FOREIGNKEYTYPE)FOREIGNVALUETYPE::schema->primaryKey().rowid( value );
+            m_value = std::make_shared<const FOREIGNVALUETYPE>( value );
+            return *m_value;
         }
 
-        FOREIGNVALUETYPE* operator->()
+        // Foreign values are shared with all the other rows pointing to the
+        // same foreign row, through the connection's identity map, and are
+        // therefore immutable.
+        const FOREIGNVALUETYPE* operator->()
         {
             fetchForeignValue();
-            return &m_value;
+            return m_value.get();
+        }
+
+        // Loads the foreign values of all the given rows at once, for the rows
+        // which didn't load theirs yet.
+        static void prefetch( CLASS* rows, size_t nbRows, ForeignKey CLASS::* field, DBConnection& conn )
+        {
+            std::vector<FOREIGNKEYTYPE> keys;
+            for ( size_t i = 0; i < nbRows; ++i )
+            {
+                auto& fk = rows[i].*field;
+                if ( fk.m_value != nullptr || fk.m_foreignKey.isNull() == true )
+                    continue;
+                fk.m_value = conn.identityMap().template get<FOREIGNVALUETYPE>( fk.m_foreignKey );
+                if ( fk.m_value == nullptr )
+                    keys.push_back( fk.m_foreignKey );
+            }
+            if ( keys.empty() == true )
+                return;
+            std::sort( keys.begin(), keys.end() );
+            keys.erase( std::unique( keys.begin(), keys.end() ), keys.end() );
+
+            const auto& pKey = FOREIGNVALUETYPE::schema->primaryKey();
+            std::map<FOREIGNKEYTYPE, std::shared_ptr<const FOREIGNVALUETYPE>> values;
+            // Stay below SQLite's default limit of 999 parameters per request
+            const size_t ChunkSize = 500;
+            for ( size_t i = 0; i < keys.size(); i += ChunkSize )
+            {
+                auto end = keys.begin() + std::min( i + ChunkSize, keys.size() );
+                std::vector<FOREIGNKEYTYPE> chunk( keys.begin() + i, end );
+                std::vector<FOREIGNVALUETYPE> fetched = FOREIGNVALUETYPE::fetch().on( conn )
+                        .where( FOREIGNVALUETYPE::primaryKey().in( chunk ) );
+                for ( auto& v : fetched )
+                {
+                    FOREIGNKEYTYPE key = (FOREIGNKEYTYPE)pKey.rowid( v );
+                    values.emplace( key, conn.identityMap().insert( key, std::move( v ) ) );
+                }
+            }
+            for ( size_t i = 0; i < nbRows; ++i )
+            {
+                auto& fk = rows[i].*field;
+                if ( fk.m_value != nullptr || fk.m_foreignKey.isNull() == true )
+                    continue;
+                auto it = values.find( fk.m_foreignKey );
+                if ( it == values.end() )
+                    continue;
+                fk.m_value = it->second;
+            }
         }
 
     private:
         void fetchForeignValue()
         {
-            if ( m_isNull == false )
+            if ( m_value != nullptr )
                 return ;
-            m_value = FOREIGNVALUETYPE::fetch().where( FOREIGNVALUETYPE::primaryKey() == m_foreignKey );
-            m_isNull = false;
+            // Don't share a blank value when there is no foreign row
+            if ( m_foreignKey.isNull() == true )
+            {
+                m_value = std::make_shared<const FOREIGNVALUETYPE>();
+                return;
+            }
+            // Stay on the connection the row was loaded from, which may be a
+            // pool reader
+            DBConnection* conn = DBConnection::fromRawConnection( m_db );
+            if ( conn == NULL )
+                conn = &DBConnection::instance();
+            auto& identityMap = conn->identityMap();
+            m_value = identityMap.template get<FOREIGNVALUETYPE>( m_foreignKey );
+            if ( m_value != nullptr )
+                return;
+            conn->profiler().onForeignKeyLoad();
+            std::vector<FOREIGNVALUETYPE> values = FOREIGNVALUETYPE::fetch().on( *conn )
+                    .where( FOREIGNVALUETYPE::primaryKey() == m_foreignKey );
+            if ( values.empty() == true )
+                m_value = std::make_shared<const FOREIGNVALUETYPE>();
+            else
+                m_value = identityMap.insert( m_foreignKey, std::move( values[0] ) );
         }
 
     private:
-        FOREIGNVALUETYPE m_value;
-        bool m_isNull = true;
+        std::shared_ptr<const FOREIGNVALUETYPE> m_value;
         Column<CLASS, FOREIGNKEYTYPE> m_foreignKey;
-        ForeignKeySchema<CLASS, FOREIGNVALUETYPE, FOREIGNKEYTYPE>* m_columnSchema;
+        // The connection the row was loaded from, if any
+        sqlite3* m_db = NULL;
         friend class ForeignKeySchema<CLASS, FOREIGNVALUETYPE, FOREIGNKEYTYPE>;
 };
 
@@ -154,41 +252,112 @@ class ColumnSchema
 
         const std::string& name() const { return m_name; }
         virtual std::string typeName() const = 0;
-        virtual std::string insert(const T& record) const = 0;
-        virtual void load(sqlite3_stmt* stmt, T& record) const = 0;
-        virtual void setSchema( T* inst ) = 0;
+        // Binds the record's value for this column to the index-th parameter
+        virtual int bind(sqlite3_stmt* stmt, int index, const T& record) const = 0;
+        // Loads the index-th column of the statement's current row. Values
+        // which don't own their memory are allocated in the arena, if provided.
+        virtual void load(sqlite3_stmt* stmt, int index, T& record, Arena* arena) const = 0;
+        // Returns the record's value for this column
+        virtual Value value(const T& record) const = 0;
+        virtual bool isDirty(const T& record) const = 0;
+        // Marks the record's value as matching the database
+        virtual void setClean(T& record) const = 0;
+        // Whether loaded values point to the arena instead of owning their memory
+        virtual bool needsArena() const { return false; }
         void setColumnIndex( int index ) { m_columnIndex = index; }
+        int columnIndex() const { return m_columnIndex; }
 
         template <typename V>
-        Predicate operator==(const V& value) const
+        Predicate operator==( const V& value ) const
         {
-            auto bindFunction = [value](sqlite3_stmt* stmt, int bindIndex)
-            {
-                return Traits<V>::Bind( stmt, bindIndex, value );
-            };
-            return Predicate( m_name, bindFunction );
+            return Predicate( m_name + " == ?", toValue( value ) );
         }
 
-        // Overload provided for direct column in where clauses
-        template <typename CLASS, typename TYPE>
-        Predicate operator==( const Column<CLASS, TYPE>& column ) const
+        template <typename V>
+        Predicate operator!=( const V& value ) const
         {
-            // Force the cast operator to use the actual value
-            return operator==((TYPE)column);
+            return Predicate( m_name + " != ?", toValue( value ) );
         }
 
-        Predicate operator==( const std::string& value ) const
+        template <typename V>
+        Predicate operator<( const V& value ) const
         {
-            char* copy = strdup( value.c_str() );
-            auto bindFunction = [copy](sqlite3_stmt* stmt, int bindIndex)
+            return Predicate( m_name + " < ?", toValue( value ) );
+        }
+
+        template <typename V>
+        Predicate operator<=( const V& value ) const
+        {
+            return Predicate( m_name + " <= ?", toValue( value ) );
+        }
+
+        template <typename V>
+        Predicate operator>( const V& value ) const
+        {
+            return Predicate( m_name + " > ?", toValue( value ) );
+        }
+
+        template <typename V>
+        Predicate operator>=( const V& value ) const
+        {
+            return Predicate( m_name + " >= ?", toValue( value ) );
+        }
+
+        template <typename V>
+        Predicate between( const V& min, const V& max ) const
+        {
+            return Predicate( m_name + " BETWEEN ? AND ?", { toValue( min ), toValue( max ) } );
+        }
+
+        Predicate like( const std::string& pattern ) const
+        {
+            return Predicate( m_name + " LIKE ?", Value( pattern ) );
+        }
+
+        Predicate isNull() const
+        {
+            return Predicate( m_name + " IS NULL", std::vector<Value>{} );
+        }
+
+        Predicate isNotNull() const
+        {
+            return Predicate( m_name + " IS NOT NULL", std::vector<Value>{} );
+        }
+
+        template <typename V>
+        Predicate in( const std::vector<V>& values ) const
+        {
+            std::string sql = m_name + " IN (";
+            std::vector<Value> bound;
+            bound.reserve( values.size() );
+            for ( const auto& v : values )
             {
-                return Traits<std::string>::Bind( stmt, bindIndex, copy, -1, free );
-            };
-            return Predicate( m_name, bindFunction );
+                sql += bound.empty() ? "?" : ",?";
+                bound.push_back( toValue( v ) );
+            }
+            sql += ')';
+            return Predicate( std::move( sql ), std::move( bound ) );
         }
-        Predicate operator==( const char* value ) const
+
+        template <typename V>
+        Predicate in( std::initializer_list<V> values ) const
+        {
+            return in( std::vector<V>( values ) );
+        }
+
+    private:
+        template <typename V>
+        static Value toValue( const V& value )
         {
-            return operator==( std::string( value ) );
+            return Value( value );
+        }
+
+        // Overload provided for direct column in where clauses
+        template <typename CLASS, typename TYPE>
+        static Value toValue( const Column<CLASS, TYPE>& column )
+        {
+            // Force the cast operator to use the actual value
+            return Value( (const TYPE&)column );
         }
 
     protected:
@@ -196,12 +365,14 @@ class ColumnSchema
         int m_columnIndex;
 };
 
-template <typename CLASS, typename TYPE>
-class ColumnSchemaImpl : public ColumnSchema<CLASS>
+// BASE is the interface implemented by the column, which may be more
+// specific than a ColumnSchema, as for primary keys.
+template <typename CLASS, typename TYPE, typename BASE>
+class ColumnSchemaImpl : public BASE
 {
     public:
         ColumnSchemaImpl(Column<CLASS, TYPE> CLASS::* fieldPtr, const std::string& name)
-            : ColumnSchema<CLASS>(name)
+            : BASE(name)
             , m_fieldPtr( fieldPtr )
         {
         }
@@ -211,42 +382,54 @@ class ColumnSchemaImpl : public ColumnSchema<CLASS>
             return Traits<TYPE>::name;
         }
 
-        virtual std::string insert(const CLASS& record) const
+        virtual bool needsArena() const
+        {
+            return std::is_same<TYPE, TextView>::value;
+        }
+
+        virtual int bind( sqlite3_stmt* stmt, int index, const CLASS& record ) const
         {
             const auto& column = (record.*m_fieldPtr);
             if ( column.isNull() )
-                return "NULL";
-            std::ostringstream oss;
-            oss << (TYPE)column;
-            if (Traits<TYPE>::need_escape)
-                return "\"" + oss.str() + "\"";
-            return oss.str();
-        }
-
-        virtual void load( sqlite3_stmt *stmt, CLASS &record ) const
-        {
-            // When using string, we need to cast the result from Traits::Load from unsigned char to char.
-            // This will be a no-op for other types
-            using LoadedType = typename std::conditional<std::is_same<TYPE, std::string>::value, char*, TYPE>::type;
-            LoadedType value = (LoadedType)Traits<TYPE>::Load( stmt, ColumnSchema<CLASS>::m_columnIndex );
-            if ( std::is_pointer<LoadedType>::value == false ||
-                 value )
-            {
-                record.*m_fieldPtr = value;
-            }
+                return sqlite3_bind_null( stmt, index );
+            return Traits<TYPE>::Bind( stmt, index, (const TYPE&)column );
+        }
+
+        virtual void load( sqlite3_stmt *stmt, int index, CLASS &record, Arena* arena ) const
+        {
+            if ( sqlite3_column_type( stmt, index ) == SQLITE_NULL )
+                return;
+            auto& column = (record.*m_fieldPtr);
+            column = Traits<TYPE>::Load( stmt, index, arena );
+            column.m_isDirty = false;
+        }
+
+        virtual bool isDirty( const CLASS& record ) const
+        {
+            return (record.*m_fieldPtr).isDirty();
         }
 
-        virtual void setSchema( CLASS *inst )
+        virtual void setClean( CLASS& record ) const
         {
-            (inst->*m_fieldPtr).m_columnSchema = this;
+            (record.*m_fieldPtr).m_isDirty = false;
+        }
+
+        virtual Value value( const CLASS& record ) const
+        {
+            const auto& column = (record.*m_fieldPtr);
+            if ( column.isNull() )
+                return Value();
+            return Value( (const TYPE&)column );
         }
 
+        Column<CLASS, TYPE> CLASS::* field() const { return m_fieldPtr; }
+
         const TYPE& load( const CLASS& instance ) const
         {
             return (instance.*m_fieldPtr);
         }
 
-        void set( CLASS& instance, const TYPE& value )
+        void set( CLASS& instance, const TYPE& value ) const
         {
             (instance.*m_fieldPtr) = value;
         }
@@ -255,18 +438,49 @@ class ColumnSchemaImpl : public ColumnSchema<CLASS>
         Column<CLASS, TYPE> CLASS::* m_fieldPtr;
 };
 
+/*
+ * Primary keys are aliases of the table's rowid, which can be accessed
+ * regardless of the key's integer type.
+ */
 template <typename CLASS>
-class PrimaryKeySchema : public ColumnSchemaImpl<CLASS, int>
+class PrimaryKeySchema : public ColumnSchema<CLASS>
 {
     public:
-        PrimaryKeySchema(Column<CLASS, int> CLASS::* fieldPtr, const std::string& name)
-            : ColumnSchemaImpl<CLASS, int>( fieldPtr, name )
+        PrimaryKeySchema(const std::string& name)
+            : ColumnSchema<CLASS>( name )
+        {
+        }
+
+        virtual int64_t rowid( const CLASS& record ) const = 0;
+        virtual void setRowid( CLASS& record, int64_t rowid ) const = 0;
+};
+
+template <typename CLASS, typename TYPE>
+class PrimaryKeySchemaImpl : public ColumnSchemaImpl<CLASS, TYPE, PrimaryKeySchema<CLASS>>
+{
+    static_assert( std::is_integral<TYPE>::value, "Primary keys alias the table rowid" );
+
+    public:
+        typedef ColumnSchemaImpl<CLASS, TYPE, PrimaryKeySchema<CLASS>> Base;
+
+        PrimaryKeySchemaImpl(Column<CLASS, TYPE> CLASS::* fieldPtr, const std::string& name)
+            : Base( fieldPtr, name )
         {
         }
 
         virtual std::string typeName() const
         {
-            return ColumnSchemaImpl<CLASS, int>::typeName() + " PRIMARY KEY AUTOINCREMENT";
+            return Base::typeName() + " PRIMARY KEY AUTOINCREMENT";
+        }
+
+        virtual int64_t rowid( const CLASS& record ) const
+        {
+            return Base::load( record );
+        }
+
+        virtual void setRowid( CLASS& record, int64_t rowid ) const
+        {
+            Base::set( record, (TYPE)rowid );
         }
 };
 
@@ -290,32 +504,44 @@ class ForeignKeySchema : public ColumnSchema<CLASS>
             return create;
         }
 
-        virtual std::string insert(const CLASS& record) const
+        virtual int bind( sqlite3_stmt* stmt, int index, const CLASS& record ) const
         {
             const auto& column = (record.*m_fieldPtr).foreignKey();
             if ( column.isNull() )
-                return "NULL";
-            std::ostringstream oss;
-            oss << (FOREIGNKEYTYPE)(column);
-            if (Traits<FOREIGNKEYTYPE>::need_escape)
-                return "\"" + oss.str() + "\"";
-            return oss.str();
+                return sqlite3_bind_null( stmt, index );
+            return Traits<FOREIGNKEYTYPE>::Bind( stmt, index, (const FOREIGNKEYTYPE&)column );
+        }
+
+        virtual void load( sqlite3_stmt *stmt, int index, CLASS &record, Arena* arena ) const
+        {
+            (record.*m_fieldPtr).m_db = sqlite3_db_handle( stmt );
+            if ( sqlite3_column_type( stmt, index ) == SQLITE_NULL )
+                return;
+            auto& column = (record.*m_fieldPtr).foreignKey();
+            column = Traits<FOREIGNKEYTYPE>::Load( stmt, index, arena );
+            column.m_isDirty = false;
         }
 
-        virtual void load( sqlite3_stmt *stmt, CLASS &record ) const
+        virtual bool isDirty( const CLASS& record ) const
         {
-            // When using string, we need to cast the result from Traits::Load from unsigned char to char.
-            // This will be a no-op for other types
-            using LoadedType = typename std::conditional<std::is_same<FOREIGNKEYTYPE, std::string>::value, char*, FOREIGNKEYTYPE>::type;
-            LoadedType value = (LoadedType)Traits<FOREIGNKEYTYPE>::Load( stmt, ColumnSchema<CLASS>::m_columnIndex );
-            (record.*m_fieldPtr).foreignKey() = value;
+            return (record.*m_fieldPtr).foreignKey().isDirty();
         }
 
-        virtual void setSchema( CLASS *inst )
+        virtual void setClean( CLASS& record ) const
         {
-            (inst->*m_fieldPtr).m_columnSchema = this;
+            (record.*m_fieldPtr).foreignKey().m_isDirty = false;
         }
 
+        virtual Value value( const CLASS& record ) const
+        {
+            const auto& column = (record.*m_fieldPtr).foreignKey();
+            if ( column.isNull() )
+                return Value();
+            return Value( (const FOREIGNKEYTYPE&)column );
+        }
+
+        ForeignKey<CLASS, FOREIGNTYPE, FOREIGNKEYTYPE> CLASS::* field() const { return m_fieldPtr; }
+
     private:
         ForeignKey<CLASS, FOREIGNTYPE, FOREIGNKEYTYPE> CLASS::* m_fieldPtr;
         const ColumnSchema<FOREIGNTYPE>& m_foreignTypePrimaryKey;
@@ -0,0 +1,93 @@
+/*****************************************************************************
+ * ConnectionOptions.hpp: Settings applied when opening a connection
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef CONNECTIONOPTIONS_HPP
+#define CONNECTIONOPTIONS_HPP
+
+#include <cstdint>
+#include <string>
+
+namespace vsqlite
+{
+
+/*
+ * Connection settings, each mapping to the PRAGMA of the same name.
+ * Empty strings and zero values leave SQLite's defaults untouched.
+ * All the profiles use WAL, so that they can be switched at runtime: the
+ * journal mode can't be changed while other connections are open.
+ */
+struct ConnectionOptions
+{
+    std::string journalMode;
+    std::string synchronous;
+    std::string tempStore;
+    // In bytes
+    int64_t mmapSize;
+    // In pages when positive, in KiB when negative
+    int64_t cacheSize;
+    // Only applies to databases which don't exist yet
+    int pageSize;
+
+    ConnectionOptions()
+        : mmapSize( 0 )
+        , cacheSize( 0 )
+        , pageSize( 0 )
+    {
+    }
+
+    // Mostly listing: map the database in memory, and cache more pages
+    static ConnectionOptions readHeavy()
+    {
+        ConnectionOptions options;
+        options.journalMode = "WAL";
+        options.synchronous = "NORMAL";
+        options.tempStore = "MEMORY";
+        options.mmapSize = 256 * 1024 * 1024;
+        options.cacheSize = -64 * 1024;
+        return options;
+    }
+
+    // Importing: don't wait for the disk, as the import can be run again
+    // if it gets interrupted
+    static ConnectionOptions bulkLoad()
+    {
+        ConnectionOptions options;
+        options.journalMode = "WAL";
+        options.synchronous = "OFF";
+        options.tempStore = "MEMORY";
+        options.cacheSize = -64 * 1024;
+        return options;
+    }
+
+    // Committed transactions survive a power loss
+    static ConnectionOptions durable()
+    {
+        ConnectionOptions options;
+        options.journalMode = "WAL";
+        options.synchronous = "FULL";
+        return options;
+    }
+};
+
+}
+
+#endif // CONNECTIONOPTIONS_HPP
@@ -0,0 +1,97 @@
+/*****************************************************************************
+ * ConnectionPool.cpp: One writer and several reader connections
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include "ConnectionPool.hpp"
+
+using namespace vsqlite;
+
+constexpr unsigned int ConnectionPool::DefaultNbReaders;
+
+bool
+ConnectionPool::init( const std::string& dbPath, unsigned int nbReaders, const ConnectionOptions& options )
+{
+    return instance()._init( dbPath, nbReaders, options );
+}
+
+void
+ConnectionPool::close()
+{
+    instance()._close();
+}
+
+bool
+ConnectionPool::_init( const std::string& dbPath, unsigned int nbReaders, const ConnectionOptions& options )
+{
+    _close();
+    // Readers can only be opened once the database is in WAL mode
+    ConnectionOptions writerOptions = options;
+    writerOptions.journalMode = "WAL";
+    if ( DBConnection::init( dbPath, writerOptions ) == false )
+        return false;
+    // Other settings are database wide, or only matter to writers
+    ConnectionOptions readerOptions;
+    readerOptions.tempStore = options.tempStore;
+    readerOptions.mmapSize = options.mmapSize;
+    readerOptions.cacheSize = options.cacheSize;
+    for ( unsigned int i = 0; i < nbReaders; ++i )
+    {
+        std::unique_ptr<DBConnection> reader( new DBConnection );
+        if ( reader->_open( dbPath, SQLITE_OPEN_READONLY ) == false ||
+             reader->configure( readerOptions ) == false )
+        {
+            _close();
+            return false;
+        }
+        m_readers.push_back( std::move( reader ) );
+    }
+    ++m_generation;
+    return true;
+}
+
+void
+ConnectionPool::_close()
+{
+    ++m_generation;
+    m_readers.clear();
+    DBConnection::close();
+}
+
+DBConnection&
+ConnectionPool::reader()
+{
+    struct ThreadReader
+    {
+        unsigned int generation;
+        DBConnection* connection;
+    };
+    static thread_local ThreadReader t_reader = { 0, NULL };
+
+    if ( m_readers.empty() )
+        return writer();
+    unsigned int generation = m_generation;
+    if ( t_reader.connection == NULL || t_reader.generation != generation )
+    {
+        t_reader.connection = m_readers[m_nextReader++ % m_readers.size()].get();
+        t_reader.generation = generation;
+    }
+    return *t_reader.connection;
+}
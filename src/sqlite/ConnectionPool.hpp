@@ -0,0 +1,88 @@
+/*****************************************************************************
+ * ConnectionPool.hpp: One writer and several reader connections
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef CONNECTIONPOOL_HPP
+#define CONNECTIONPOOL_HPP
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "DBConnection.hpp"
+
+namespace vsqlite
+{
+
+/*
+ * Opens the database in WAL mode, so that readers don't block on the writer.
+ * The default DBConnection is the single writer, and each thread gets
+ * assigned one of the read only connections.
+ * This requires a database file: a ":memory:" database can't be shared
+ * between connections.
+ */
+class ConnectionPool
+{
+    public:
+        static constexpr unsigned int DefaultNbReaders = 4;
+
+        // The options apply to all the connections, except for the journal
+        // mode, which is always WAL.
+        static bool init( const std::string& dbPath, unsigned int nbReaders = DefaultNbReaders,
+                          const ConnectionOptions& options = ConnectionOptions::readHeavy() );
+        static void close();
+
+        static ConnectionPool& instance()
+        {
+            static ConnectionPool s_instance;
+            return s_instance;
+        }
+
+        // The connection to use for writing, which is DBConnection::instance()
+        DBConnection& writer() { return DBConnection::instance(); }
+        // The read only connection assigned to the calling thread. When more
+        // threads than readers are used, a reader is shared by several threads.
+        DBConnection& reader();
+
+        size_t nbReaders() const { return m_readers.size(); }
+
+    private:
+        ConnectionPool()
+            : m_generation( 0 )
+            , m_nextReader( 0 )
+        {
+        }
+
+        bool _init( const std::string& dbPath, unsigned int nbReaders, const ConnectionOptions& options );
+        void _close();
+
+    private:
+        std::vector<std::unique_ptr<DBConnection>> m_readers;
+        // Bumped every time the pool is (re)initialized, so threads don't
+        // keep using a reader from a previous initialization.
+        std::atomic<unsigned int> m_generation;
+        std::atomic<unsigned int> m_nextReader;
+};
+
+}
+
+#endif // CONNECTIONPOOL_HPP
@@ -0,0 +1,125 @@
+/*****************************************************************************
+ * Cursor.hpp: Lazily iterates over a request's results
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef CURSOR_HPP
+#define CURSOR_HPP
+
+#include <cstddef>
+#include <iterator>
+#include <memory>
+
+#include "Operation.hpp"
+
+namespace vsqlite
+{
+
+/*
+ * Input range over the results of a FetchOperation. The statement only gets
+ * stepped as the range is iterated, and a single row is kept in memory.
+ * As with any input range, it can only be iterated once, and TextView columns
+ * of a row are only valid until the cursor moves to the next one.
+ */
+template <typename T>
+class Cursor
+{
+    public:
+        class iterator
+        {
+            public:
+                typedef std::input_iterator_tag iterator_category;
+                typedef T value_type;
+                typedef std::ptrdiff_t difference_type;
+                typedef T* pointer;
+                typedef T& reference;
+
+                explicit iterator( Cursor* cursor = NULL )
+                    : m_cursor( cursor )
+                {
+                }
+
+                T& operator*() const { return m_cursor->m_row; }
+                T* operator->() const { return &m_cursor->m_row; }
+
+                iterator& operator++()
+                {
+                    if ( m_cursor->next() == false )
+                        m_cursor = NULL;
+                    return *this;
+                }
+
+                bool operator==( const iterator& it ) const { return m_cursor == it.m_cursor; }
+                bool operator!=( const iterator& it ) const { return m_cursor != it.m_cursor; }
+
+            private:
+                Cursor* m_cursor;
+        };
+
+        Cursor( FetchOperation<T>&& operation )
+            : m_operation( std::move( operation ) )
+            , m_arena( new Arena )
+            , m_started( false )
+            , m_hasRow( false )
+        {
+        }
+
+        Cursor( Cursor&& ) = default;
+        Cursor( const Cursor& ) = delete;
+
+        iterator begin()
+        {
+            if ( m_started == false )
+            {
+                m_started = true;
+                m_hasRow = m_operation.execute( m_operation.connection().rawConnection() ) &&
+                        next();
+            }
+            return m_hasRow ? iterator( this ) : end();
+        }
+
+        iterator end()
+        {
+            return iterator();
+        }
+
+    private:
+        bool next()
+        {
+            // Start from a blank row, so NULL columns don't keep a previous value.
+            // Values the previous row stored in the arena are released as well.
+            m_row = T();
+            m_arena->clear();
+            m_operation.m_arena = m_arena.get();
+            m_hasRow = m_operation.loadRow( m_row );
+            return m_hasRow;
+        }
+
+    private:
+        FetchOperation<T> m_operation;
+        std::unique_ptr<Arena> m_arena;
+        T m_row;
+        bool m_started;
+        bool m_hasRow;
+};
+
+}
+
+#endif // CURSOR_HPP
@@ -22,6 +22,10 @@
 
 #include "DBConnection.hpp"
 
+#include <algorithm>
+#include <mutex>
+
+#include "ConnectionPool.hpp"
 #include "Table.hpp"
 
 using namespace vsqlite;
@@ -32,29 +36,371 @@ DBConnection::registerTableSchema( ITableSchema* schema )
     instance().m_tables.push_back( schema );
 }
 
-void
+static bool execute( sqlite3* db, const std::string& request )
+{
+    if ( sqlite3_exec( db, request.c_str(), NULL, NULL, NULL ) != SQLITE_OK )
+    {
+        std::cerr << "Failed to run " << request << ": " << sqlite3_errmsg( db ) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Runs a request returning a single integer, bound to the given text.
+// Returns -1 when no row is returned.
+static int64_t fetchInteger( sqlite3* db, const std::string& request, const std::string& parameter )
+{
+    sqlite3_stmt* stmt;
+    if ( sqlite3_prepare_v2( db, request.c_str(), -1, &stmt, NULL ) != SQLITE_OK )
+        return -1;
+    if ( parameter.empty() == false )
+        sqlite3_bind_text( stmt, 1, parameter.c_str(), parameter.size(), SQLITE_STATIC );
+    int64_t res = -1;
+    if ( sqlite3_step( stmt ) == SQLITE_ROW )
+        res = sqlite3_column_int64( stmt, 0 );
+    sqlite3_finalize( stmt );
+    return res;
+}
+
+static bool storeVersion( sqlite3* db, const std::string& table, int64_t version, uint32_t definition )
+{
+    sqlite3_stmt* stmt;
+    if ( sqlite3_prepare_v2( db, "INSERT OR REPLACE INTO vsqlite_schema VALUES(?, ?, ?)", -1, &stmt, NULL ) != SQLITE_OK )
+        return false;
+    sqlite3_bind_text( stmt, 1, table.c_str(), table.size(), SQLITE_STATIC );
+    sqlite3_bind_int64( stmt, 2, version );
+    sqlite3_bind_int64( stmt, 3, definition );
+    bool res = sqlite3_step( stmt ) == SQLITE_DONE;
+    if ( res == false )
+        std::cerr << "Failed to store the version of " << table << ": " << sqlite3_errmsg( db ) << std::endl;
+    sqlite3_finalize( stmt );
+    return res;
+}
+
+// 32 bits FNV-1a
+static uint32_t hash( const std::string& value, uint32_t h = 2166136261u )
+{
+    for ( auto c : value )
+    {
+        h ^= (uint8_t)c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Identifies the registered tables, including their version and indexes.
+// Tables get registered in the order static variables are initialized in,
+// so the table hashes are combined independently of their order.
+static int32_t schemaHash( const std::vector<ITableSchema*>& tables )
+{
+    uint32_t res = 0;
+    for ( auto t : tables )
+    {
+        uint32_t h = hash( t->create().request() );
+        for ( const auto& index : t->createIndexes() )
+            h = hash( index.request(), h );
+        res += hash( std::to_string( t->version() ), h );
+    }
+    // user_version is signed, and 0 for new databases
+    res &= 0x7fffffff;
+    return res != 0 ? res : 1;
+}
+
+bool
 DBConnection::createTables()
 {
+    // Skip all DDL when the schema didn't change since the last time
+    int32_t schema = schemaHash( m_tables );
+    if ( fetchInteger( m_db, "PRAGMA user_version", "" ) == schema )
+        return true;
+    Transaction transaction( m_db, Transaction::Mode::Immediate );
+    if ( transaction.isValid() == false ||
+         execute( m_db, "CREATE TABLE IF NOT EXISTS vsqlite_schema("
+                        "name TEXT PRIMARY KEY, version INTEGER NOT NULL, hash INTEGER NOT NULL)" ) == false )
+        return false;
     for ( auto t : m_tables )
     {
-        if ( t->create().execute( DBConnection::instance().rawConnection() ) == false )
+        int64_t version = t->version();
+        uint32_t definition = hash( t->create().request() );
+        bool exists = fetchInteger( m_db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?",
+                                    t->name() ) == 1;
+        if ( exists == false )
+        {
+            if ( t->create().execute( m_db ) == false )
+            {
+                std::cerr << "Failed to create table \"" << t->name() << '"' << std::endl;
+                return false;
+            }
+        }
+        else
+        {
+            // Tables created before they were versioned are at version 0
+            int64_t stored = fetchInteger( m_db, "SELECT version FROM vsqlite_schema WHERE name = ?", t->name() );
+            int64_t current = std::max<int64_t>( 0, stored );
+            bool migrated = false;
+            for ( const auto& m : t->migrations() )
+            {
+                if ( m->toVersion() <= current )
+                    continue;
+                if ( execute( m_db, m->request() ) == false )
+                {
+                    std::cerr << "Failed to migrate \"" << t->name() << "\" to version "
+                              << m->toVersion() << std::endl;
+                    return false;
+                }
+                current = m->toVersion();
+                migrated = true;
+            }
+            if ( current != version )
+            {
+                std::cerr << "No migration takes \"" << t->name() << "\" from version " << current
+                          << " to version " << version << std::endl;
+                return false;
+            }
+            // Otherwise, the stored table wouldn't match its declaration
+            if ( migrated == false && stored >= 0 &&
+                 fetchInteger( m_db, "SELECT hash FROM vsqlite_schema WHERE name = ?", t->name() ) != definition )
+            {
+                std::cerr << "The declaration of \"" << t->name() << "\" changed without a new version "
+                             "and its migration" << std::endl;
+                return false;
+            }
+        }
+        if ( storeVersion( m_db, t->name(), version, definition ) == false )
+            return false;
+        // Indexes wouldn't be retried once the schema hash is stored
+        for ( auto& index : t->createIndexes() )
         {
-            std::cerr << "Failed to create table \"" << t->name() << '"' << std::endl;
-            return;
+            if ( index.execute( m_db ) == false )
+            {
+                std::cerr << "Failed to create an index on \"" << t->name() << '"' << std::endl;
+                return false;
+            }
         }
     }
+    if ( execute( m_db, "PRAGMA user_version = " + std::to_string( schema ) ) == false )
+        return false;
+    return transaction.commit();
+}
+
+// Connections which are currently open, for fromRawConnection() to look up.
+// This is never released, as the default connection may be closed by its
+// destructor, after all other statics are gone.
+static std::vector<DBConnection*>& openConnections()
+{
+    static auto connections = new std::vector<DBConnection*>;
+    return *connections;
+}
+
+static std::mutex openConnectionsLock;
+
+bool
+DBConnection::_init( const std::string& dbPath, const ConnectionOptions& options )
+{
+    if ( _open( dbPath, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE ) == false )
+        return false;
+    // Before any table gets created, for the page size to apply
+    if ( configure( options ) == false )
+    {
+        _close();
+        return false;
+    }
+    if ( createTables() == false )
+    {
+        _close();
+        return false;
+    }
+    return true;
+}
+
+// Copies src to dst, releasing both connections between steps. Gives up
+// if a transaction is in progress on src, as the backup would then read
+// its uncommitted changes. The destination is left untouched in this case.
+static bool backup( sqlite3* dst, sqlite3* src, int pagesPerStep )
+{
+    sqlite3_backup* b = sqlite3_backup_init( dst, "main", src, "main" );
+    if ( b == NULL )
+    {
+        std::cerr << "Failed to start backup: " << sqlite3_errmsg( dst ) << std::endl;
+        return false;
+    }
+    int res;
+    bool inTransaction = false;
+    do
+    {
+        // Nothing may start a transaction between the check and the step
+        sqlite3_mutex* mutex = sqlite3_db_mutex( src );
+        sqlite3_mutex_enter( mutex );
+        inTransaction = sqlite3_get_autocommit( src ) == 0;
+        if ( inTransaction == false )
+            res = sqlite3_backup_step( b, pagesPerStep );
+        sqlite3_mutex_leave( mutex );
+        if ( inTransaction == true )
+            break;
+        if ( res == SQLITE_BUSY || res == SQLITE_LOCKED )
+            sqlite3_sleep( 10 );
+        else if ( res == SQLITE_OK )
+            sqlite3_sleep( 1 );
+    } while ( res == SQLITE_OK || res == SQLITE_BUSY || res == SQLITE_LOCKED );
+    // An unfinished backup rolls back the changes made to the destination
+    res = sqlite3_backup_finish( b );
+    if ( res != SQLITE_OK )
+    {
+        std::cerr << "Failed to backup database: " << sqlite3_errstr( res ) << std::endl;
+        return false;
+    }
+    return inTransaction == false;
 }
 
 bool
-DBConnection::_init(const std::string& dbPath)
+DBConnection::_initInMemory( const std::string& snapshotPath, const ConnectionOptions& options )
 {
-    int res = sqlite3_open( dbPath.c_str(), &m_db );
+    if ( ConnectionPool::instance().nbReaders() > 0 )
+    {
+        std::cerr << "In-memory databases can't be used along with the connection pool" << std::endl;
+        return false;
+    }
+    if ( _open( ":memory:", SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE ) == false )
+        return false;
+    sqlite3* snapshot;
+    if ( sqlite3_open_v2( snapshotPath.c_str(), &snapshot, SQLITE_OPEN_READONLY, NULL ) == SQLITE_OK )
+    {
+        // An in-memory destination can't change its page size while restoring
+        auto pageSize = fetchInteger( snapshot, "PRAGMA page_size", "" );
+        bool res = pageSize > 0 && pragma( "page_size", std::to_string( pageSize ) ) &&
+                backup( m_db, snapshot, -1 );
+        sqlite3_close( snapshot );
+        if ( res == false )
+        {
+            _close();
+            return false;
+        }
+    }
+    else
+        sqlite3_close( snapshot );
+    // In-memory databases are always in "memory" journal mode, which the
+    // profiles' WAL mode can't apply to
+    ConnectionOptions memoryOptions = options;
+    memoryOptions.journalMode.clear();
+    if ( configure( memoryOptions ) == false || createTables() == false )
+    {
+        _close();
+        return false;
+    }
+    m_snapshotPath = snapshotPath;
+    return true;
+}
+
+bool
+DBConnection::flush( int pagesPerStep )
+{
+    if ( isInMemory() == false )
+        return false;
+    std::lock_guard<std::mutex> lock( m_flushLock );
+    sqlite3* snapshot;
+    if ( sqlite3_open_v2( m_snapshotPath.c_str(), &snapshot, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                          NULL ) != SQLITE_OK )
+    {
+        std::cerr << "Failed to open " << m_snapshotPath << ": " << sqlite3_errmsg( snapshot ) << std::endl;
+        sqlite3_close( snapshot );
+        return false;
+    }
+    bool res = backup( snapshot, m_db, pagesPerStep );
+    sqlite3_close( snapshot );
+    return res;
+}
+
+void
+DBConnection::setAutoFlush( std::chrono::milliseconds interval, int pagesPerStep )
+{
+    if ( m_flushThread.joinable() == true )
+    {
+        {
+            std::lock_guard<std::mutex> lock( m_autoFlushLock );
+            m_autoFlush = false;
+        }
+        m_autoFlushCond.notify_all();
+        m_flushThread.join();
+    }
+    if ( interval.count() <= 0 || isInMemory() == false )
+        return;
+    m_autoFlush = true;
+    m_flushThread = std::thread( [this, interval, pagesPerStep]() {
+        std::unique_lock<std::mutex> lock( m_autoFlushLock );
+        while ( m_autoFlushCond.wait_for( lock, interval, [this]() { return m_autoFlush == false; } ) == false )
+        {
+            lock.unlock();
+            flush( pagesPerStep );
+            lock.lock();
+        }
+    } );
+}
+
+bool
+DBConnection::configure( const ConnectionOptions& options )
+{
+    if ( options.pageSize > 0 && pragma( "page_size", std::to_string( options.pageSize ) ) == false )
+        return false;
+    if ( options.journalMode.empty() == false )
+    {
+        // Unsupported modes are ignored, and the current mode is returned:
+        // for instance, in-memory databases stay in "memory" mode
+        std::string mode;
+        if ( pragma( "journal_mode", options.journalMode, &mode ) == false )
+            return false;
+        if ( sqlite3_stricmp( mode.c_str(), options.journalMode.c_str() ) != 0 )
+        {
+            std::cerr << "Failed to set journal_mode to " << options.journalMode
+                      << ": still in " << mode << " mode" << std::endl;
+            return false;
+        }
+    }
+    if ( options.synchronous.empty() == false && pragma( "synchronous", options.synchronous ) == false )
+        return false;
+    if ( options.tempStore.empty() == false && pragma( "temp_store", options.tempStore ) == false )
+        return false;
+    if ( options.mmapSize > 0 && pragma( "mmap_size", std::to_string( options.mmapSize ) ) == false )
+        return false;
+    if ( options.cacheSize != 0 && pragma( "cache_size", std::to_string( options.cacheSize ) ) == false )
+        return false;
+    return true;
+}
+
+bool
+DBConnection::pragma( const std::string& name, const std::string& value, std::string* result )
+{
+    auto request = "PRAGMA " + name + " = " + value;
+    auto storeResult = []( void* result, int nbColumns, char** values, char** ) {
+        if ( result != NULL && nbColumns > 0 && values[0] != NULL )
+            *static_cast<std::string*>( result ) = values[0];
+        return 0;
+    };
+    if ( sqlite3_exec( m_db, request.c_str(), storeResult, result, NULL ) != SQLITE_OK )
+    {
+        std::cerr << "Failed to run " << request << ": " << errorMsg() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool
+DBConnection::_open( const std::string& dbPath, int flags )
+{
+    int res = sqlite3_open_v2( dbPath.c_str(), &m_db, flags, NULL );
     m_isValid = ( res == SQLITE_OK );
-    if ( m_isValid )
+    if ( m_isValid == false )
     {
-        createTables();
+        std::cerr << "Failed to open " << dbPath << ": " << errorMsg() << std::endl;
+        // A handle is allocated even when opening fails
+        sqlite3_close( m_db );
+        m_db = NULL;
+        return false;
     }
-    return m_isValid;
+    m_statementCache.reset( m_db );
+    m_identityMap.clear();
+    std::lock_guard<std::mutex> lock( openConnectionsLock );
+    openConnections().push_back( this );
+    return true;
 }
 
 DBConnection::~DBConnection()
@@ -62,14 +408,83 @@ DBConnection::~DBConnection()
     _close();
 }
 
+DBConnection*
+DBConnection::fromRawConnection( sqlite3* db )
+{
+    if ( db == NULL )
+        return NULL;
+    // Most requests go through the default connection
+    DBConnection& conn = instance();
+    if ( conn.m_db == db )
+        return &conn;
+    std::lock_guard<std::mutex> lock( openConnectionsLock );
+    for ( auto c : openConnections() )
+    {
+        if ( c->m_db == db )
+            return c;
+    }
+    return NULL;
+}
+
 void
+DBConnection::invalidateCachedRow( const void* table, int64_t key )
+{
+    std::lock_guard<std::mutex> lock( openConnectionsLock );
+    for ( auto c : openConnections() )
+        c->m_identityMap.invalidate( table, key );
+}
+
+void
+DBConnection::invalidateCachedRows( const void* table )
+{
+    std::lock_guard<std::mutex> lock( openConnectionsLock );
+    for ( auto c : openConnections() )
+        c->m_identityMap.invalidate( table );
+}
+
+bool
 DBConnection::_close()
 {
-    sqlite3_close( instance().m_db );
-    instance().m_db = NULL;
+    if ( m_db == NULL )
+        return true;
+    bool res = true;
+    if ( isInMemory() == true )
+    {
+        setAutoFlush( std::chrono::milliseconds( 0 ) );
+        // The connection is going away: copy everything in a single step
+        res = flush( -1 );
+        m_snapshotPath.clear();
+    }
+    {
+        std::lock_guard<std::mutex> lock( openConnectionsLock );
+        auto& connections = openConnections();
+        connections.erase( std::remove( connections.begin(), connections.end(), this ),
+                           connections.end() );
+    }
+    setProfiling( false );
+    m_queryPlanChecker.disable();
+    // Cached statements would prevent the connection from being closed
+    m_statementCache.reset( NULL );
+    m_identityMap.clear();
+    sqlite3_close( m_db );
+    m_db = NULL;
+    m_isValid = false;
+    return res;
+}
+
+void
+DBConnection::setProfiling( bool enabled )
+{
+    if ( m_db == NULL )
+        return;
+    if ( enabled == true )
+        sqlite3_trace_v2( m_db, SQLITE_TRACE_STMT | SQLITE_TRACE_PROFILE | SQLITE_TRACE_ROW, &Profiler::trace, &m_profiler );
+    else
+        sqlite3_trace_v2( m_db, 0, NULL, NULL );
+    m_profiler.setEnabled( enabled );
 }
 
-void DBConnection::close()
+bool DBConnection::close()
 {
-    instance()._close();
+    return instance()._close();
 }
@@ -23,25 +23,53 @@
 #ifndef DBCONNECTION_HPP
 #define DBCONNECTION_HPP
 
+#include <chrono>
+#include <condition_variable>
 #include <iostream>
+#include <mutex>
 #include <sqlite3.h>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "ConnectionOptions.hpp"
+#include "IdentityMap.hpp"
+#include "Profiler.hpp"
+#include "QueryPlanChecker.hpp"
+#include "StatementCache.hpp"
+#include "Transaction.hpp"
+
 namespace vsqlite
 {
 
 class ITableSchema;
+class ConnectionPool;
 
 class DBConnection
 {
     public:
-        static bool init( const std::string& dbPath )
+        static bool init( const std::string& dbPath,
+                          const ConnectionOptions& options = ConnectionOptions() )
+        {
+            return instance()._init( dbPath, options );
+        }
+
+        // Opens an in-memory database, loaded from the snapshot file if it
+        // exists. Changes only reach the file when flush() gets called, either
+        // explicitly, by the auto flush timer, or when closing the connection.
+        // Whatever was written since the last flush is lost upon a crash.
+        // The ConnectionPool can't be used in this mode, as its readers open
+        // the database file: this fails while the pool is initialized.
+        static bool initInMemory( const std::string& snapshotPath,
+                                  const ConnectionOptions& options = ConnectionOptions() )
         {
-            return instance()._init( dbPath );
+            return instance()._initInMemory( snapshotPath, options );
         }
 
-        static void close();
+        // Returns false if the final flush of an in-memory database failed.
+        // The connection gets closed regardless: call flush() beforehand to
+        // handle the failure.
+        static bool close();
 
         static DBConnection& instance()
         {
@@ -53,25 +81,84 @@ class DBConnection
         const char* errorMsg() const { return sqlite3_errmsg( m_db ); }
 
         sqlite3*    rawConnection() { return m_db; }
+        StatementCache& statementCache() { return m_statementCache; }
+        IdentityMap& identityMap() { return m_identityMap; }
+        Profiler& profiler() { return m_profiler; }
+        // Disabled by default, as it runs extra requests
+        QueryPlanChecker& queryPlanChecker() { return m_queryPlanChecker; }
+
+        // Applies the options to the open connection, for instance to switch
+        // to ConnectionOptions::bulkLoad() during an import. The journal mode
+        // can't be changed within a transaction.
+        bool configure( const ConnectionOptions& options );
+
+        // Starts, or stops, recording statement timings and ORM counters in
+        // the connection's profiler.
+        void setProfiling( bool enabled );
+
+        // Copies an in-memory database to its snapshot file, pagesPerStep
+        // pages at a time, or all at once when negative. The connection is
+        // released between steps, so requests don't wait for the whole copy
+        // to complete. Only committed data is copied: the flush is skipped,
+        // returning false, while a transaction is in progress, and the file
+        // keeps its previous snapshot.
+        bool flush( int pagesPerStep = 256 );
+        // Flushes periodically from a background thread. A zero interval
+        // stops flushing.
+        void setAutoFlush( std::chrono::milliseconds interval, int pagesPerStep = 256 );
+        bool isInMemory() const { return m_snapshotPath.empty() == false; }
+
+        Transaction newTransaction( Transaction::Mode mode = Transaction::Mode::Deferred )
+        {
+            return Transaction( m_db, mode );
+        }
+
+        // Returns the connection wrapping the given handle, or NULL if the
+        // handle wasn't opened through a DBConnection
+        static DBConnection* fromRawConnection( sqlite3* db );
+
+        ~DBConnection();
 
         static void registerTableSchema( ITableSchema* schema );
 
+        // Drops a row, or a whole table, from the identity map of all the
+        // open connections. This must be called when rows get modified.
+        static void invalidateCachedRow( const void* table, int64_t key );
+        static void invalidateCachedRows( const void* table );
+
     private:
         DBConnection()
-            : m_isValid( false )
+            : m_db( NULL )
+            , m_isValid( false )
+            , m_autoFlush( false )
         {
         }
 
-        ~DBConnection();
-
-        bool _init( const std::string& dbPath );
-        void _close();
-        void createTables();
+        bool _init( const std::string& dbPath, const ConnectionOptions& options );
+        bool _initInMemory( const std::string& snapshotPath, const ConnectionOptions& options );
+        // Stores the row returned by the pragma, if any, in result
+        bool pragma( const std::string& name, const std::string& value, std::string* result = NULL );
+        bool _open( const std::string& dbPath, int flags );
+        bool _close();
+        bool createTables();
 
     private:
         sqlite3*    m_db;
         bool        m_isValid;
+        StatementCache m_statementCache;
+        IdentityMap m_identityMap;
+        Profiler m_profiler;
+        QueryPlanChecker m_queryPlanChecker;
         std::vector<ITableSchema*> m_tables;
+        // Only set for in-memory databases
+        std::string m_snapshotPath;
+        std::mutex m_flushLock;
+        std::thread m_flushThread;
+        std::mutex m_autoFlushLock;
+        std::condition_variable m_autoFlushCond;
+        bool m_autoFlush;
+
+        friend class ConnectionPool;
 };
 
 }
@@ -0,0 +1,120 @@
+/*****************************************************************************
+ * IdentityMap.cpp: Shared cache of rows, by table & primary key
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include "IdentityMap.hpp"
+
+using namespace vsqlite;
+
+constexpr size_t IdentityMap::DefaultCapacity;
+
+IdentityMap::IdentityMap( size_t capacity )
+    : m_capacity( capacity )
+{
+}
+
+std::shared_ptr<const void>
+IdentityMap::find( const void* table, int64_t key )
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    auto it = m_index.find( Key{ table, key } );
+    if ( it == m_index.end() )
+        return nullptr;
+    m_entries.splice( m_entries.begin(), m_entries, it->second );
+    return it->second->second;
+}
+
+void
+IdentityMap::put( const void* table, int64_t key, std::shared_ptr<const void> value )
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    Key k{ table, key };
+    auto it = m_index.find( k );
+    if ( it != m_index.end() )
+    {
+        it->second->second = std::move( value );
+        m_entries.splice( m_entries.begin(), m_entries, it->second );
+        return;
+    }
+    m_entries.emplace_front( k, std::move( value ) );
+    m_index[k] = m_entries.begin();
+    evict();
+}
+
+void
+IdentityMap::invalidate( const void* table, int64_t key )
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    auto it = m_index.find( Key{ table, key } );
+    if ( it == m_index.end() )
+        return;
+    m_entries.erase( it->second );
+    m_index.erase( it );
+}
+
+void
+IdentityMap::invalidate( const void* table )
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    for ( auto it = m_entries.begin(); it != m_entries.end(); )
+    {
+        if ( it->first.table != table )
+        {
+            ++it;
+            continue;
+        }
+        m_index.erase( it->first );
+        it = m_entries.erase( it );
+    }
+}
+
+void
+IdentityMap::clear()
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    m_entries.clear();
+    m_index.clear();
+}
+
+void
+IdentityMap::setCapacity( size_t capacity )
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    m_capacity = capacity;
+    evict();
+}
+
+size_t
+IdentityMap::size() const
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    return m_entries.size();
+}
+
+void
+IdentityMap::evict()
+{
+    while ( m_entries.size() > m_capacity )
+    {
+        m_index.erase( m_entries.back().first );
+        m_entries.pop_back();
+    }
+}
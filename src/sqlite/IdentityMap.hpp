@@ -0,0 +1,107 @@
+/*****************************************************************************
+ * IdentityMap.hpp: Shared cache of rows, by table & primary key
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef IDENTITYMAP_HPP
+#define IDENTITYMAP_HPP
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace vsqlite
+{
+
+/*
+ * Keeps one shared, immutable instance per row, identified by its table and
+ * its primary key, so all the foreign keys pointing to the same row share it.
+ * The least recently used rows are evicted once the capacity is reached.
+ */
+class IdentityMap
+{
+    public:
+        static constexpr size_t DefaultCapacity = 1024;
+
+        IdentityMap( size_t capacity = DefaultCapacity );
+
+        IdentityMap( const IdentityMap& ) = delete;
+        IdentityMap& operator=( const IdentityMap& ) = delete;
+
+        template <typename T>
+        std::shared_ptr<const T> get( int64_t key )
+        {
+            return std::static_pointer_cast<const T>( find( T::schema, key ) );
+        }
+
+        template <typename T>
+        std::shared_ptr<const T> insert( int64_t key, T&& value )
+        {
+            auto res = std::make_shared<const T>( std::move( value ) );
+            put( T::schema, key, res );
+            return res;
+        }
+
+        // Table is the table's schema
+        void invalidate( const void* table, int64_t key );
+        void invalidate( const void* table );
+        void clear();
+
+        void setCapacity( size_t capacity );
+        size_t capacity() const { return m_capacity; }
+        size_t size() const;
+
+    private:
+        std::shared_ptr<const void> find( const void* table, int64_t key );
+        void put( const void* table, int64_t key, std::shared_ptr<const void> value );
+        void evict();
+
+    private:
+        struct Key
+        {
+            const void* table;
+            int64_t key;
+
+            bool operator==( const Key& k ) const { return table == k.table && key == k.key; }
+        };
+
+        struct KeyHash
+        {
+            size_t operator()( const Key& k ) const
+            {
+                return std::hash<const void*>()( k.table ) ^ std::hash<int64_t>()( k.key );
+            }
+        };
+
+        typedef std::pair<Key, std::shared_ptr<const void>> Entry;
+        typedef std::list<Entry> Entries;
+
+        size_t m_capacity;
+        // Most recently used rows are kept at the front
+        Entries m_entries;
+        std::unordered_map<Key, Entries::iterator, KeyHash> m_index;
+        mutable std::mutex m_lock;
+};
+
+}
+
+#endif // IDENTITYMAP_HPP
@@ -23,10 +23,20 @@
 #ifndef OPERATION_HPP
 #define OPERATION_HPP
 
+#include <algorithm>
 #include <cassert>
+#include <functional>
+#include <iterator>
+#include <memory>
 #include <sqlite3.h>
+#include <type_traits>
+#include <vector>
+
 #include "DBConnection.hpp"
+#include "Transaction.hpp"
 
+#include "ResultSet.hpp"
+#include "Tools.hpp"
 #include "WhereClause.hpp"
 
 namespace vsqlite
@@ -38,17 +48,21 @@ class Operation
         Operation(const std::string& request)
             : m_request( request )
             , m_statement( NULL )
+            , m_cache( NULL )
+            , m_connection( NULL )
         {
         }
 
         Operation()
             : m_statement( NULL )
+            , m_cache( NULL )
+            , m_connection( NULL )
         {
         }
 
         virtual ~Operation()
         {
-            sqlite3_finalize( m_statement );
+            releaseStatement();
         }
 
         Operation& operator+=( Operation&& op )
@@ -58,98 +72,541 @@ class Operation
             return *this;
         }
 
+        const std::string& request() const { return m_request; }
+
         Operation( const Operation& op ) = delete;
-        Operation( Operation&& op ) = default;
+        Operation( Operation&& op )
+            : m_request( std::move( op.m_request ) )
+            , m_statement( op.m_statement )
+            , m_cache( op.m_cache )
+            , m_connection( op.m_connection )
+        {
+            op.m_statement = NULL;
+            op.m_cache = NULL;
+        }
 
     protected:
         virtual bool execute( sqlite3* db )
         {
-            int resultCode = sqlite3_prepare_v2( db, m_request.c_str(), -1, &m_statement, NULL );
+            // Don't hand a previous statement back to the cache, as the
+            // request it was prepared from might have changed since.
+            sqlite3_finalize( m_statement );
+            m_statement = NULL;
+            // Use the connection's statement cache when we know about it
+            DBConnection* conn = DBConnection::fromRawConnection( db );
+            int resultCode;
+            if ( conn != NULL )
+            {
+                m_cache = &conn->statementCache();
+                bool prepared;
+                resultCode = m_cache->acquire( m_request, &m_statement, &prepared );
+                if ( resultCode == SQLITE_OK && prepared == true )
+                    conn->profiler().onPrepare();
+                if ( resultCode == SQLITE_OK && conn->queryPlanChecker().isEnabled() == true )
+                    conn->queryPlanChecker().check( db, m_request );
+            }
+            else
+                resultCode = sqlite3_prepare_v2( db, m_request.c_str(), -1, &m_statement, NULL );
             if ( resultCode != SQLITE_OK )
             {
                 std::cerr << "Failed to execute request " << m_request << '\n'
                              << "Error code: " << resultCode << '(' <<
-                             DBConnection::instance().errorMsg() << ')' << std::endl;
+                             sqlite3_errmsg( db ) << ')' << std::endl;
+                m_cache = NULL;
                 return false;
             }
             return true;
         }
 
+        // The connection the operation runs on, unless explicitly executed
+        // on a raw handle
+        DBConnection& connection()
+        {
+            if ( m_connection == NULL )
+                return DBConnection::instance();
+            return *m_connection;
+        }
+
         operator sqlite3_stmt*()
         {
             assert( m_statement != NULL );
             return m_statement;
         }
 
+    private:
+        void releaseStatement()
+        {
+            if ( m_cache != NULL )
+                m_cache->release( m_request, m_statement );
+            else
+                sqlite3_finalize( m_statement );
+            m_statement = NULL;
+            m_cache = NULL;
+        }
+
     protected:
         std::string m_request;
         sqlite3_stmt* m_statement;
+        // The cache m_statement has been acquired from, if any
+        StatementCache* m_cache;
+        // Defaults to DBConnection::instance() when NULL
+        DBConnection* m_connection;
+};
+
+template <typename T>
+class Cursor;
+
+template <typename, typename>
+class Column;
+
+template <typename, typename, typename>
+class ForeignKey;
+
+template <typename T>
+class ColumnSchema;
+
+enum class SortOrder
+{
+    Ascending,
+    Descending,
 };
 
 template <typename T>
 class FetchOperation : public Operation
 {
     public:
-        FetchOperation( const std::string& request )
-            : Operation( request )
+        FetchOperation()
+            : m_arena( NULL )
+            , m_limit( -1 )
+            , m_offset( 0 )
         {
         }
 
+        // Without an arena to own them, TextView columns can't be loaded by
+        // these conversions: the rows are rejected instead.
         operator T()
         {
-            bool res = execute( DBConnection::instance().rawConnection() );
-            if ( res == false )
+            if ( checkOwnership() == false )
                 return T();
-            auto results = parseResults();
-            if ( results.size() == 0 )
+            bool res = execute( connection().rawConnection() );
+            T row;
+            // Don't step any further than the first row
+            if ( res == false || loadRow( row ) == false )
                 return T();
-            return results[0];
+            prefetch( &row, 1 );
+            return row;
         }
 
         operator std::vector<T>()
         {
-            bool res = execute( DBConnection::instance().rawConnection() );
+            if ( checkOwnership() == false )
+                return std::vector<T>();
+            bool res = execute( connection().rawConnection() );
             if ( res == false )
                 return std::vector<T>();
             auto results = parseResults();
+            prefetch( results.data(), results.size() );
+            return results;
+        }
+
+        // Unlike a std::vector, a ResultSet also owns the memory TextView
+        // columns point to.
+        operator ResultSet<T>()
+        {
+            ResultSet<T> results;
+            bool res = execute( connection().rawConnection() );
+            if ( res == false )
+                return results;
+            m_arena = results.m_arena.get();
+            results.m_rows = parseResults();
+            m_arena = NULL;
+            prefetch( results.m_rows.data(), results.m_rows.size() );
             return results;
         }
 
+        // Returns a range that loads rows one at a time, as it gets iterated
+        Cursor<T> cursor()
+        {
+            return Cursor<T>( std::move( *this ) );
+        }
+
+        // Runs the request on a specific connection, such as one of the
+        // ConnectionPool readers.
+        FetchOperation&& on( DBConnection& conn )
+        {
+            m_connection = &conn;
+            return std::move( *this );
+        }
+
+        // Eagerly loads the given foreign key of all the fetched rows, with
+        // a single request, instead of one request per row on first access.
+        // This doesn't apply to cursors, which only see a row at a time.
+        template <typename FOREIGNVALUETYPE, typename FOREIGNKEYTYPE>
+        FetchOperation&& with( ForeignKey<T, FOREIGNVALUETYPE, FOREIGNKEYTYPE> T::* field )
+        {
+            m_prefetches.push_back( [field]( T* rows, size_t nbRows, DBConnection& conn ) {
+                ForeignKey<T, FOREIGNVALUETYPE, FOREIGNKEYTYPE>::prefetch( rows, nbRows, field, conn );
+            } );
+            return std::move( *this );
+        }
+
         FetchOperation&& where( WhereClause&& clause )
         {
             m_whereClause = std::move( clause );
             return std::move( *this );
         }
 
+        // Only loads the given columns, instead of all of them. An empty
+        // list selects all the columns again.
+        template <typename... FIELDS>
+        FetchOperation&& select( FIELDS T::*... fields )
+        {
+            m_columns.clear();
+            int expand[] = { 0, ( addColumn( fields ), 0 )... };
+            (void)expand;
+            return std::move( *this );
+        }
+
+        // Sorts the results by the given column. Can be called several times
+        // to sort by multiple columns. The primary key gets appended as a
+        // last sorting column, so that the order is always deterministic.
+        FetchOperation&& orderBy( const ColumnSchema<T>& column, SortOrder order = SortOrder::Ascending )
+        {
+            m_orderBy.push_back( std::make_pair( &column, order ) );
+            return std::move( *this );
+        }
+
+        template <typename FIELD>
+        FetchOperation&& orderBy( FIELD T::* field, SortOrder order = SortOrder::Ascending )
+        {
+            auto column = T::schema->column( field );
+            if ( column == nullptr )
+                std::cerr << "Can't sort by an unregistered column of " << T::schema->name() << std::endl;
+            else
+                m_orderBy.push_back( std::make_pair( column.get(), order ) );
+            return std::move( *this );
+        }
+
+        FetchOperation&& limit( int64_t nbRows )
+        {
+            m_limit = nbRows;
+            return std::move( *this );
+        }
+
+        FetchOperation&& offset( int64_t nbRows )
+        {
+            m_offset = nbRows;
+            return std::move( *this );
+        }
+
+        // Only fetches the rows sorted after the given one, which usually is
+        // the last row of the previous page. Unlike offset(), this doesn't
+        // need to step over all the previous pages, as long as the sorting
+        // columns are indexed. Sorting columns are expected not to be NULL.
+        FetchOperation&& after( const T& lastRow )
+        {
+            m_after.reset( new T( lastRow ) );
+            return std::move( *this );
+        }
+
         virtual bool execute( sqlite3 *db )
         {
-            m_request += m_whereClause.generate();
-            if ( Operation::execute( db ) == false )
+            // Always name the columns: a migrated table doesn't necessarily
+            // store them in declaration order
+            std::string columns;
+            for ( const auto& c : m_columns.empty() ? T::schema->columns() : m_columns )
+                columns += c->name() + ',';
+            columns.erase( columns.size() - 1 );
+            auto orderBy = sortingColumns();
+            auto keyset = keysetPredicate( orderBy );
+            m_request = generate( columns, orderBy, keyset );
+            return prepare( db, keyset );
+        }
+
+        // Aggregates are computed by SQLite, without loading any row.
+        // When the results are limited or paged, they only account for the
+        // rows of the page.
+
+        int64_t count()
+        {
+            if ( aggregate( "COUNT(*)" ) == false )
+                return 0;
+            return sqlite3_column_int64( m_statement, 0 );
+        }
+
+        bool exists()
+        {
+            auto orderBy = sortingColumns();
+            auto keyset = keysetPredicate( orderBy );
+            m_request = "SELECT EXISTS(" + generate( "1", orderBy, keyset ) + ')';
+            if ( prepare( connection().rawConnection(), keyset ) == false ||
+                 sqlite3_step( m_statement ) != SQLITE_ROW )
                 return false;
-            return m_whereClause.bind( m_statement );
+            return sqlite3_column_int( m_statement, 0 ) != 0;
+        }
+
+        // Returns a null column when no row matches
+        template <typename TYPE>
+        Column<T, TYPE> min( Column<T, TYPE> T::* field )
+        {
+            return extremum( "MIN", field );
+        }
+
+        template <typename TYPE>
+        Column<T, TYPE> max( Column<T, TYPE> T::* field )
+        {
+            return extremum( "MAX", field );
+        }
+
+        // Integer columns are summed as integers, other ones as reals.
+        template <typename TYPE>
+        typename std::conditional<std::is_integral<TYPE>::value, int64_t, double>::type
+        sum( Column<T, TYPE> T::* field )
+        {
+            auto column = T::schema->column( field );
+            if ( column == nullptr || aggregate( "SUM(" + column->name() + ')' ) == false )
+                return 0;
+            if ( std::is_integral<TYPE>::value == true )
+                return sqlite3_column_int64( m_statement, 0 );
+            return sqlite3_column_double( m_statement, 0 );
+        }
+
+        template <typename TYPE>
+        double avg( Column<T, TYPE> T::* field )
+        {
+            auto column = T::schema->column( field );
+            if ( column == nullptr || aggregate( "AVG(" + column->name() + ')' ) == false )
+                return 0;
+            return sqlite3_column_double( m_statement, 0 );
         }
 
     protected:
         std::vector<T> parseResults()
         {
             std::vector<T> results;
-            while ( sqlite3_step( m_statement ) != SQLITE_DONE )
+            T row;
+            while ( loadRow( row ) == true )
             {
-                T row;
-                const auto& attributes = T::schema->columns();
-                for ( auto a : attributes )
+                results.push_back( std::move( row ) );
+                row = T();
+            }
+            return results;
+        }
+
+        void prefetch( T* rows, size_t nbRows )
+        {
+            for ( auto& p : m_prefetches )
+                p( rows, nbRows, connection() );
+        }
+
+        // Steps to the next row and loads it. Returns false when the results
+        // are exhausted or an error occurred.
+        bool loadRow( T& row )
+        {
+            int res = sqlite3_step( m_statement );
+            if ( res != SQLITE_ROW )
+            {
+                if ( res != SQLITE_DONE )
+                    std::cerr << "Failed to fetch row from " << m_request << '\n'
+                              << "Error code: " << res << std::endl;
+                return false;
+            }
+            connection().profiler().onRowLoaded( T::schema->name() );
+            if ( m_columns.empty() == true )
+                T::schema->loadRow( m_statement, row, m_arena );
+            else
+            {
+                // Projected columns are loaded from their position in the
+                // select list, rather than in the table
+                for ( size_t i = 0; i < m_columns.size(); ++i )
+                    m_columns[i]->load( m_statement, i, row, m_arena );
+            }
+            return true;
+        }
+
+    private:
+        typedef std::vector<std::pair<const ColumnSchema<T>*, SortOrder>> SortingColumns;
+
+        bool checkOwnership() const
+        {
+            bool needsArena = m_columns.empty() ? T::schema->needsArena() :
+                    std::any_of( m_columns.begin(), m_columns.end(), []( const std::shared_ptr<ColumnSchema<T>>& c ) {
+                        return c->needsArena();
+                    } );
+            if ( needsArena == true )
+            {
+                std::cerr << "Rows of " << T::schema->name() << " with TextView columns must be "
+                             "fetched in a ResultSet or a Cursor" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        std::string generate( const std::string& columns, const SortingColumns& orderBy,
+                              const Predicate& keyset ) const
+        {
+            std::string request = "SELECT " + columns + " FROM " + T::schema->name();
+            auto where = m_whereClause.generate();
+            if ( keyset.sql().empty() == false )
+                where += ( where.empty() ? " WHERE " : " AND " ) + keyset.sql();
+            request += where;
+            for ( size_t i = 0; i < orderBy.size(); ++i )
+            {
+                request += i == 0 ? " ORDER BY " : ", ";
+                request += orderBy[i].first->name();
+                request += orderBy[i].second == SortOrder::Ascending ? " ASC" : " DESC";
+            }
+            if ( isLimited() == true )
+                request += " LIMIT ?";
+            if ( m_offset > 0 )
+                request += " OFFSET ?";
+            return request;
+        }
+
+        // Prepares m_request and binds its parameters, in the order generate()
+        // inserted them.
+        bool prepare( sqlite3* db, const Predicate& keyset )
+        {
+            if ( Operation::execute( db ) == false )
+                return false;
+            int bindIndex = 1;
+            if ( m_whereClause.bind( m_statement, bindIndex ) == false ||
+                 keyset.bind( m_statement, bindIndex ) != SQLITE_OK )
+                return false;
+            // A negative limit means no limit
+            if ( isLimited() == true && sqlite3_bind_int64( m_statement, bindIndex++, m_limit ) != SQLITE_OK )
+                return false;
+            if ( m_offset > 0 && sqlite3_bind_int64( m_statement, bindIndex++, m_offset ) != SQLITE_OK )
+                return false;
+            return true;
+        }
+
+        bool isLimited() const
+        {
+            return m_limit >= 0 || m_offset > 0;
+        }
+
+        // Runs an aggregate request and steps to its single row
+        bool aggregate( const std::string& expression )
+        {
+            auto orderBy = sortingColumns();
+            auto keyset = keysetPredicate( orderBy );
+            // Paged rows have to be selected first, so they are the only ones
+            // being aggregated
+            if ( isLimited() == true || m_after != nullptr )
+                m_request = "SELECT " + expression + " FROM (" + generate( "*", orderBy, keyset ) + ')';
+            else
+                m_request = generate( expression, SortingColumns(), keyset );
+            if ( prepare( connection().rawConnection(), keyset ) == false )
+                return false;
+            return sqlite3_step( m_statement ) == SQLITE_ROW;
+        }
+
+        template <typename TYPE>
+        Column<T, TYPE> extremum( const char* function, Column<T, TYPE> T::* field )
+        {
+            static_assert( std::is_same<TYPE, TextView>::value == false,
+                           "A TextView wouldn't outlive the request" );
+            Column<T, TYPE> res;
+            auto column = T::schema->column( field );
+            if ( column == nullptr ||
+                 aggregate( std::string( function ) + '(' + column->name() + ')' ) == false ||
+                 sqlite3_column_type( m_statement, 0 ) == SQLITE_NULL )
+                return res;
+            res = Traits<TYPE>::Load( m_statement, 0, NULL );
+            return res;
+        }
+
+        Predicate keysetPredicate( const SortingColumns& orderBy ) const
+        {
+            if ( m_after == nullptr )
+                return Predicate( std::string(), std::vector<Value>() );
+            return keysetPredicate( orderBy, *m_after );
+        }
+
+        // The requested sorting columns, followed by the primary key as a
+        // tie breaker when ordering or paging.
+        SortingColumns sortingColumns() const
+        {
+            auto res = m_orderBy;
+            if ( res.empty() == true && m_after == nullptr )
+                return res;
+            const ColumnSchema<T>* pKey = &T::schema->primaryKey();
+            for ( const auto& c : res )
+            {
+                if ( c.first == pKey )
+                    return res;
+            }
+            auto order = res.empty() ? SortOrder::Ascending : res.back().second;
+            res.push_back( std::make_pair( pKey, order ) );
+            return res;
+        }
+
+        // Matches the rows sorted after lastRow. When all the columns are
+        // sorted the same way, this is a single row value comparison, which
+        // SQLite can resolve with an index. Otherwise, this is expanded to
+        // (a > ?) OR (a = ? AND b < ?) OR ...
+        static Predicate keysetPredicate( const SortingColumns& orderBy, const T& lastRow )
+        {
+            bool sameOrder = true;
+            for ( const auto& c : orderBy )
+                sameOrder = sameOrder && c.second == orderBy[0].second;
+            std::vector<Value> values;
+            std::string sql;
+            if ( sameOrder == true )
+            {
+                std::string params;
+                for ( const auto& c : orderBy )
                 {
-                    a->load( m_statement, row );
+                    sql += ( sql.empty() ? "(" : ", " ) + c.first->name();
+                    params += params.empty() ? "(?" : ", ?";
+                    values.push_back( c.first->value( lastRow ) );
                 }
+                sql += orderBy[0].second == SortOrder::Ascending ? ") > " : ") < ";
+                sql += params + ')';
+                return Predicate( std::move( sql ), std::move( values ) );
+            }
+            for ( size_t i = 0; i < orderBy.size(); ++i )
+            {
+                sql += sql.empty() ? "((" : " OR (";
+                for ( size_t j = 0; j < i; ++j )
+                {
+                    sql += orderBy[j].first->name() + " = ? AND ";
+                    values.push_back( orderBy[j].first->value( lastRow ) );
+                }
+                sql += orderBy[i].first->name();
+                sql += orderBy[i].second == SortOrder::Ascending ? " > ?)" : " < ?)";
+                values.push_back( orderBy[i].first->value( lastRow ) );
+            }
+            sql += ')';
+            return Predicate( std::move( sql ), std::move( values ) );
+        }
 
-                results.push_back( std::move( row ) );
+        template <typename FIELD>
+        void addColumn( FIELD T::* field )
+        {
+            auto column = T::schema->column( field );
+            if ( column == nullptr )
+            {
+                std::cerr << "Can't select an unregistered column of " << T::schema->name() << std::endl;
+                return;
             }
-            return results;
+            m_columns.push_back( column );
         }
 
     protected:
         WhereClause m_whereClause;
+        // Where values which don't own their memory get stored, if any
+        Arena* m_arena;
+        std::vector<std::function<void(T*, size_t, DBConnection&)>> m_prefetches;
+        // Selected columns, or empty to select all of them
+        std::vector<std::shared_ptr<ColumnSchema<T>>> m_columns;
+        SortingColumns m_orderBy;
+        int64_t m_limit;
+        int64_t m_offset;
+        std::unique_ptr<T> m_after;
 
+        friend class Cursor<T>;
 };
 
 template <typename CLASS>
@@ -157,36 +614,54 @@ class InsertOperation : public Operation
 {
     public:
         InsertOperation( CLASS& record )
-            : m_record( record )
+            : Operation( CLASS::schema->insertRequest() )
+            , m_record( record )
         {
-            m_request = "INSERT INTO " + CLASS::schema->name() + " VALUES(";
-            const auto& columns = CLASS::schema->columns();
-            for ( auto attr : columns )
-            {
-                m_request += attr->insert( record ) + ',';
-            }
-            m_request.replace(m_request.end() - 1, m_request.end(), ");");
         }
 
         virtual bool execute( sqlite3* db )
         {
             if ( Operation::execute( db ) == false )
                 return false;
+            return insert( db, m_statement, m_record );
+        }
+
+        // Binds the record to a ready to use insert statement, executes it,
+        // and stores the generated primary key back in the record.
+        static bool insert( sqlite3* db, sqlite3_stmt* statement, CLASS& record )
+        {
+            int resultCode = CLASS::schema->bindRow( statement, record );
+            if ( resultCode != SQLITE_OK )
+            {
+                std::cerr << "Failed to bind record to " << CLASS::schema->name()
+                          << ". Error code #" << resultCode << std::endl;
+                return false;
+            }
             // We still need to step on the request for it to be executed.
-            int res = sqlite3_step( m_statement );
-            while ( res != SQLITE_DONE && res != SQLITE_ERROR )
+            int res = sqlite3_step( statement );
+            while ( res == SQLITE_ROW )
             {
-                res = sqlite3_step( m_statement );
+                res = sqlite3_step( statement );
             }
-            auto& pKey = CLASS::schema->primaryKey();
-            int pKeyValue = sqlite3_last_insert_rowid( db );
-            pKey.set( m_record, pKeyValue );
-            return res != SQLITE_ERROR;
+            if ( res != SQLITE_DONE )
+                return false;
+            int64_t pKeyValue = sqlite3_last_insert_rowid( db );
+            CLASS::schema->primaryKey().setRowid( record, pKeyValue );
+            CLASS::schema->setClean( record );
+            // The row may replace one that some connections already cached
+            DBConnection::invalidateCachedRow( CLASS::schema, pKeyValue );
+            return true;
+        }
+
+        InsertOperation&& on( DBConnection& conn )
+        {
+            m_connection = &conn;
+            return std::move( *this );
         }
 
         operator bool()
         {
-            return execute( DBConnection::instance().rawConnection() );
+            return execute( connection().rawConnection() );
         }
 
         InsertOperation( const InsertOperation& ) = delete;
@@ -196,6 +671,395 @@ class InsertOperation : public Operation
         CLASS& m_record;
 };
 
+/*
+ * Inserts a range of records within a single transaction, reusing the same
+ * statement for each of them.
+ */
+template <typename CLASS, typename ITERATOR>
+class InsertManyOperation : public Operation
+{
+    public:
+        InsertManyOperation( ITERATOR begin, ITERATOR end )
+            : Operation( CLASS::schema->insertRequest() )
+            , m_begin( begin )
+            , m_end( end )
+        {
+        }
+
+        virtual bool execute( sqlite3* db )
+        {
+            // Within a caller's transaction, this will only be a savepoint
+            Transaction t( db );
+            if ( t.isValid() == false || insertAll( db ) == false )
+                return false;
+            return t.commit();
+        }
+
+        InsertManyOperation&& on( DBConnection& conn )
+        {
+            m_connection = &conn;
+            return std::move( *this );
+        }
+
+        operator bool()
+        {
+            return execute( connection().rawConnection() );
+        }
+
+        InsertManyOperation( const InsertManyOperation& ) = delete;
+        InsertManyOperation( InsertManyOperation&& ) = default;
+
+    private:
+        bool insertAll( sqlite3* db )
+        {
+            if ( Operation::execute( db ) == false )
+                return false;
+            for ( auto it = m_begin; it != m_end; ++it )
+            {
+                if ( InsertOperation<CLASS>::insert( db, m_statement, *it ) == false )
+                    return false;
+                sqlite3_reset( m_statement );
+            }
+            return true;
+        }
+
+    private:
+        ITERATOR m_begin;
+        ITERATOR m_end;
+};
+
+/*
+ * Inserts records, or resolves the rows they conflict with, in a single
+ * statement per record. Conflicts are detected on a set of columns, which
+ * must be covered by a unique index. On conflict, the existing row is either
+ * updated with the record's values (upsert), optionally restricted to the
+ * columns passed to update(), or left untouched (find or create). In both
+ * cases, the row's primary key is stored in the record.
+ */
+template <typename CLASS, typename ITERATOR>
+class UpsertOperation : public Operation
+{
+    public:
+        typedef std::vector<std::shared_ptr<ColumnSchema<CLASS>>> Columns;
+
+        UpsertOperation( ITERATOR begin, ITERATOR end, Columns conflictColumns, bool update )
+            : m_begin( begin )
+            , m_end( end )
+            , m_conflictColumns( std::move( conflictColumns ) )
+            , m_update( update )
+        {
+        }
+
+        UpsertOperation&& on( DBConnection& conn )
+        {
+            m_connection = &conn;
+            return std::move( *this );
+        }
+
+        // Restricts the columns overwritten with the record's values on
+        // conflict, which are all of them by default. The existing row's
+        // other columns are kept.
+        template <typename... FIELDS>
+        UpsertOperation&& update( FIELDS CLASS::*... fields )
+        {
+            Columns columns = { CLASS::schema->column( fields )... };
+            for ( const auto& c : columns )
+            {
+                if ( c == nullptr )
+                    std::cerr << "Can't update an unregistered column of " << CLASS::schema->name() << std::endl;
+                else
+                    m_updateColumns.push_back( c );
+            }
+            return std::move( *this );
+        }
+
+        virtual bool execute( sqlite3* db )
+        {
+            if ( m_conflictColumns.empty() == true )
+            {
+                std::cerr << "Upserting into " << CLASS::schema->name() << " requires conflict columns" << std::endl;
+                return false;
+            }
+            // A single record doesn't need the extra statements of a transaction
+            if ( m_begin == m_end || std::next( m_begin ) == m_end )
+                return upsertAll( db );
+            Transaction t( db );
+            if ( t.isValid() == false || upsertAll( db ) == false )
+                return false;
+            return t.commit();
+        }
+
+        operator bool()
+        {
+            return execute( connection().rawConnection() );
+        }
+
+        UpsertOperation( const UpsertOperation& ) = delete;
+        UpsertOperation( UpsertOperation&& ) = default;
+
+    private:
+        // Lookup of an existing row, when its conflicting insert did nothing
+        class FindOperation : public Operation
+        {
+            public:
+                FindOperation( const std::string& request ) : Operation( request ) {}
+                bool prepare( sqlite3* db ) { return Operation::execute( db ); }
+                sqlite3_stmt* statement() { return m_statement; }
+        };
+
+        bool upsertAll( sqlite3* db )
+        {
+            const auto& pKey = CLASS::schema->primaryKey();
+            std::string target;
+            std::string find = "SELECT " + pKey.name() + " FROM " + CLASS::schema->name() + " WHERE ";
+            for ( const auto& c : m_conflictColumns )
+            {
+                target += ( target.empty() ? "" : "," ) + c->name();
+                // IS also matches NULL values
+                find += ( c == m_conflictColumns.front() ? "" : " AND " ) + c->name() + " IS ?";
+            }
+            m_request = CLASS::schema->insertRequest() + " ON CONFLICT(" + target + ") ";
+            if ( m_update == true )
+            {
+                std::string assignments;
+                const auto& columns = m_updateColumns.empty() ? CLASS::schema->columns() : m_updateColumns;
+                for ( const auto& c : columns )
+                {
+                    if ( c.get() == &pKey || std::find( m_conflictColumns.begin(), m_conflictColumns.end(), c ) != m_conflictColumns.end() )
+                        continue;
+                    assignments += ( assignments.empty() ? "" : ", " ) + c->name() + " = excluded." + c->name();
+                }
+                // Only conflict columns: the update is a no-op returning the row
+                if ( assignments.empty() == true )
+                    assignments = m_conflictColumns.front()->name() + " = excluded." + m_conflictColumns.front()->name();
+                m_request += "DO UPDATE SET " + assignments;
+            }
+            else
+                m_request += "DO NOTHING";
+            m_request += " RETURNING " + pKey.name();
+            if ( Operation::execute( db ) == false )
+                return false;
+            FindOperation findOp( find );
+            bool findPrepared = false;
+            for ( auto it = m_begin; it != m_end; ++it )
+            {
+                CLASS& record = *it;
+                int resultCode = CLASS::schema->bindRow( m_statement, record );
+                if ( resultCode != SQLITE_OK )
+                {
+                    std::cerr << "Failed to bind record to " << CLASS::schema->name()
+                              << ". Error code #" << resultCode << std::endl;
+                    return false;
+                }
+                int res = sqlite3_step( m_statement );
+                bool found = res == SQLITE_ROW;
+                int64_t pKeyValue = found ? sqlite3_column_int64( m_statement, 0 ) : 0;
+                while ( res == SQLITE_ROW )
+                    res = sqlite3_step( m_statement );
+                sqlite3_reset( m_statement );
+                if ( res != SQLITE_DONE )
+                {
+                    std::cerr << "Failed to upsert into " << CLASS::schema->name() << ": "
+                              << sqlite3_errmsg( db ) << std::endl;
+                    return false;
+                }
+                if ( found == false )
+                {
+                    if ( findPrepared == false && findOp.prepare( db ) == false )
+                        return false;
+                    findPrepared = true;
+                    auto stmt = findOp.statement();
+                    for ( size_t i = 0; i < m_conflictColumns.size(); ++i )
+                    {
+                        if ( m_conflictColumns[i]->bind( stmt, i + 1, record ) != SQLITE_OK )
+                            return false;
+                    }
+                    res = sqlite3_step( stmt );
+                    found = res == SQLITE_ROW;
+                    if ( found == true )
+                        pKeyValue = sqlite3_column_int64( stmt, 0 );
+                    sqlite3_reset( stmt );
+                    if ( found == false )
+                    {
+                        std::cerr << "Conflicting " << CLASS::schema->name() << " row not found. "
+                                  << "Are the conflict columns covered by a unique index?" << std::endl;
+                        return false;
+                    }
+                }
+                pKey.setRowid( record, pKeyValue );
+                CLASS::schema->setClean( record );
+                // The row may have been updated, or replaced
+                DBConnection::invalidateCachedRow( CLASS::schema, pKeyValue );
+            }
+            return true;
+        }
+
+    private:
+        ITERATOR m_begin;
+        ITERATOR m_end;
+        Columns m_conflictColumns;
+        Columns m_updateColumns;
+        bool m_update;
+};
+
+/*
+ * Updates either the modified columns of a record, or the given columns of
+ * all the rows matching a where clause.
+ */
+template <typename CLASS>
+class UpdateOperation : public Operation
+{
+    public:
+        UpdateOperation()
+            : m_record( NULL )
+        {
+        }
+
+        UpdateOperation( CLASS& record )
+            : m_record( &record )
+        {
+            for ( const auto& c : CLASS::schema->columns() )
+            {
+                if ( c->isDirty( record ) == true )
+                    set( *c, c->value( record ) );
+            }
+            const auto& pKey = CLASS::schema->primaryKey();
+            m_whereClause = WhereClause( pKey == pKey.value( record ) );
+        }
+
+        template <typename FIELD, typename V>
+        UpdateOperation&& set( FIELD CLASS::* field, const V& value )
+        {
+            auto column = CLASS::schema->column( field );
+            if ( column == nullptr )
+                std::cerr << "Can't update an unregistered column of " << CLASS::schema->name() << std::endl;
+            else
+                set( *column, Value( value ) );
+            return std::move( *this );
+        }
+
+        UpdateOperation&& set( const ColumnSchema<CLASS>& column, Value value )
+        {
+            m_columns.push_back( column.name() );
+            m_values.push_back( std::move( value ) );
+            return std::move( *this );
+        }
+
+        UpdateOperation&& where( WhereClause&& clause )
+        {
+            m_whereClause = std::move( clause );
+            return std::move( *this );
+        }
+
+        UpdateOperation&& on( DBConnection& conn )
+        {
+            m_connection = &conn;
+            return std::move( *this );
+        }
+
+        virtual bool execute( sqlite3* db )
+        {
+            if ( m_record != NULL && CLASS::schema->primaryKey().value( *m_record ).type() == Value::Type::Null )
+            {
+                std::cerr << "Can't save a " << CLASS::schema->name() << " row which wasn't inserted" << std::endl;
+                return false;
+            }
+            // Nothing was modified
+            if ( m_columns.empty() == true )
+                return true;
+            m_request = "UPDATE " + CLASS::schema->name() + " SET ";
+            for ( size_t i = 0; i < m_columns.size(); ++i )
+                m_request += ( i == 0 ? "" : ", " ) + m_columns[i] + " = ?";
+            m_request += m_whereClause.generate();
+            if ( Operation::execute( db ) == false )
+                return false;
+            int bindIndex = 1;
+            for ( const auto& v : m_values )
+            {
+                if ( v.bind( m_statement, bindIndex++ ) != SQLITE_OK )
+                    return false;
+            }
+            if ( m_whereClause.bind( m_statement, bindIndex ) == false )
+                return false;
+            int res = sqlite3_step( m_statement );
+            while ( res == SQLITE_ROW )
+                res = sqlite3_step( m_statement );
+            if ( res != SQLITE_DONE )
+            {
+                std::cerr << "Failed to update " << CLASS::schema->name() << ": "
+                          << sqlite3_errmsg( db ) << std::endl;
+                return false;
+            }
+            if ( m_record != NULL )
+            {
+                CLASS::schema->setClean( *m_record );
+                DBConnection::invalidateCachedRow( CLASS::schema,
+                                                   CLASS::schema->primaryKey().rowid( *m_record ) );
+            }
+            else
+                DBConnection::invalidateCachedRows( CLASS::schema );
+            return true;
+        }
+
+        operator bool()
+        {
+            return execute( connection().rawConnection() );
+        }
+
+        UpdateOperation( const UpdateOperation& ) = delete;
+        UpdateOperation( UpdateOperation&& ) = default;
+
+    private:
+        // Saved record, if any
+        CLASS* m_record;
+        std::vector<std::string> m_columns;
+        std::vector<Value> m_values;
+        WhereClause m_whereClause;
+};
+
+template <typename CLASS>
+class DeleteOperation : public Operation
+{
+    public:
+        DeleteOperation&& where( WhereClause&& clause )
+        {
+            m_whereClause = std::move( clause );
+            return std::move( *this );
+        }
+
+        DeleteOperation&& on( DBConnection& conn )
+        {
+            m_connection = &conn;
+            return std::move( *this );
+        }
+
+        virtual bool execute( sqlite3* db )
+        {
+            m_request = "DELETE FROM " + CLASS::schema->name() + m_whereClause.generate();
+            if ( Operation::execute( db ) == false || m_whereClause.bind( m_statement ) == false )
+                return false;
+            int res = sqlite3_step( m_statement );
+            while ( res == SQLITE_ROW )
+                res = sqlite3_step( m_statement );
+            if ( res != SQLITE_DONE )
+            {
+                std::cerr << "Failed to delete from " << CLASS::schema->name() << ": "
+                          << sqlite3_errmsg( db ) << std::endl;
+                return false;
+            }
+            DBConnection::invalidateCachedRows( CLASS::schema );
+            return true;
+        }
+
+        operator bool()
+        {
+            return execute( connection().rawConnection() );
+        }
+
+    private:
+        WhereClause m_whereClause;
+};
+
 class CreateTableOperation : public Operation
 {
     public:
@@ -215,14 +1079,38 @@ class CreateTableOperation : public Operation
                 return false;
             // We still need to step on the request for it to be executed.
             int res = sqlite3_step( m_statement );
-            while ( res != SQLITE_DONE && res != SQLITE_ERROR )
+            while ( res == SQLITE_ROW )
             {
                 res = sqlite3_step( m_statement );
             }
-            return res != SQLITE_ERROR;
+            return res == SQLITE_DONE;
         }
+};
 
+class CreateIndexOperation : public Operation
+{
+    public:
+        CreateIndexOperation( const std::string& table, const std::string& name,
+                              const std::vector<std::string>& columns, bool unique )
+        {
+            m_request = std::string( "CREATE " ) + ( unique ? "UNIQUE " : "" ) +
+                    "INDEX IF NOT EXISTS " + name + " ON " + table + '(';
+            for ( const auto& c : columns )
+                m_request += c + ',';
+            m_request.replace(m_request.end() - 1, m_request.end(), ")");
+        }
 
+        virtual bool execute( sqlite3* db )
+        {
+            if ( Operation::execute( db ) == false )
+                return false;
+            int res = sqlite3_step( m_statement );
+            while ( res == SQLITE_ROW )
+            {
+                res = sqlite3_step( m_statement );
+            }
+            return res == SQLITE_DONE;
+        }
 };
 
 }
@@ -0,0 +1,189 @@
+/*****************************************************************************
+ * Profiler.cpp: Per connection statement timings and ORM counters
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include "Profiler.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace vsqlite;
+
+const size_t Profiler::NbBuckets;
+
+Profiler::Profiler()
+    : m_enabled( false )
+    , m_prepares( 0 )
+    , m_steps( 0 )
+    , m_foreignKeyLoads( 0 )
+    , m_slowQueryThreshold( 0 )
+{
+}
+
+void
+Profiler::setSlowQueryCallback( SlowQueryCallback callback, Duration threshold )
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    m_slowQueryCallback = std::move( callback );
+    m_slowQueryThreshold = threshold.count();
+}
+
+std::vector<Profiler::StatementProfile>
+Profiler::snapshot() const
+{
+    std::vector<StatementProfile> res;
+    std::lock_guard<std::mutex> lock( m_lock );
+    for ( const auto& s : m_statements )
+    {
+        const Stats& stats = s.second;
+        // Smallest bucket holding at least 99% of the executions
+        uint64_t threshold = stats.count - stats.count / 100;
+        uint64_t nb = 0;
+        size_t b = 0;
+        for ( ; b < NbBuckets - 1; ++b )
+        {
+            nb += stats.histogram[b];
+            if ( nb >= threshold )
+                break;
+        }
+        auto p99 = std::min( bucketUpperBound( b ), stats.max );
+        res.push_back( StatementProfile{ s.first, stats.count, Duration( stats.total ), Duration( p99 ) } );
+    }
+    std::sort( res.begin(), res.end(), []( const StatementProfile& a, const StatementProfile& b ) {
+        return a.total > b.total;
+    } );
+    return res;
+}
+
+void
+Profiler::reset()
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    m_statements.clear();
+    m_rowsLoaded.clear();
+    m_running.clear();
+    m_prepares = 0;
+    m_steps = 0;
+    m_foreignKeyLoads = 0;
+}
+
+std::map<std::string, uint64_t>
+Profiler::rowsLoaded() const
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    return m_rowsLoaded;
+}
+
+void
+Profiler::onRowLoaded( const std::string& table )
+{
+    if ( isEnabled() == false )
+        return;
+    std::lock_guard<std::mutex> lock( m_lock );
+    ++m_rowsLoaded[table];
+}
+
+size_t
+Profiler::bucket( uint64_t nanoseconds )
+{
+    if ( nanoseconds < 4 )
+        return nanoseconds;
+    size_t msb = 63 - __builtin_clzll( nanoseconds );
+    return 4 * ( msb - 1 ) + ( ( nanoseconds >> ( msb - 2 ) ) & 3 );
+}
+
+uint64_t
+Profiler::bucketUpperBound( size_t bucket )
+{
+    if ( bucket < 4 )
+        return bucket;
+    size_t msb = bucket / 4 + 1;
+    return ( ( 4 + bucket % 4 + 1 ) << ( msb - 2 ) ) - 1;
+}
+
+int
+Profiler::trace( unsigned int type, void* data, void* p, void* x )
+{
+    auto self = static_cast<Profiler*>( data );
+    if ( type == SQLITE_TRACE_STMT )
+    {
+        // Triggers' sub programs are reported as "-- comments"
+        auto sql = static_cast<const char*>( x );
+        if ( sql == NULL || strncmp( sql, "--", 2 ) != 0 )
+            self->onStatementStart( static_cast<sqlite3_stmt*>( p ) );
+    }
+    else if ( type == SQLITE_TRACE_ROW )
+        ++self->m_steps;
+    else if ( type == SQLITE_TRACE_PROFILE )
+    {
+        ++self->m_steps;
+        self->onStatement( static_cast<sqlite3_stmt*>( p ), *static_cast<sqlite3_int64*>( x ) );
+    }
+    return 0;
+}
+
+void
+Profiler::onStatementStart( sqlite3_stmt* stmt )
+{
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock( m_lock );
+    m_running[stmt] = now;
+}
+
+void
+Profiler::onStatement( sqlite3_stmt* stmt, uint64_t nanoseconds )
+{
+    auto now = std::chrono::steady_clock::now();
+    const char* sql = sqlite3_sql( stmt );
+    if ( sql == NULL )
+        return;
+    SlowQueryCallback callback;
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        auto it = m_running.find( stmt );
+        if ( it != m_running.end() )
+        {
+            nanoseconds = std::chrono::duration_cast<Duration>( now - it->second ).count();
+            m_running.erase( it );
+        }
+        auto& stats = m_statements[sql];
+        if ( stats.histogram.empty() == true )
+        {
+            stats.count = 0;
+            stats.total = 0;
+            stats.max = 0;
+            stats.histogram.resize( NbBuckets );
+        }
+        ++stats.count;
+        stats.total += nanoseconds;
+        stats.max = std::max( stats.max, nanoseconds );
+        ++stats.histogram[bucket( nanoseconds )];
+        if ( m_slowQueryCallback != nullptr && nanoseconds >= m_slowQueryThreshold )
+            callback = m_slowQueryCallback;
+    }
+    // Don't hold the lock while running user code
+    if ( callback != nullptr )
+    {
+        char* expanded = sqlite3_expanded_sql( stmt );
+        callback( expanded != NULL ? expanded : sql, Duration( nanoseconds ) );
+        sqlite3_free( expanded );
+    }
+}
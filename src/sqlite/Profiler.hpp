@@ -0,0 +1,136 @@
+/*****************************************************************************
+ * Profiler.hpp: Per connection statement timings and ORM counters
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef PROFILER_HPP
+#define PROFILER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sqlite3.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace vsqlite
+{
+
+/*
+ * Statistics about the statements run on a connection, and about what the
+ * ORM did to run them. Statements are timed by SQLite, through
+ * sqlite3_trace_v2, and are identified by their parametrized SQL text.
+ * Nothing is recorded until the connection enables profiling.
+ */
+class Profiler
+{
+    public:
+        typedef std::chrono::nanoseconds Duration;
+        typedef std::function<void( const std::string& sql, Duration duration )> SlowQueryCallback;
+
+        struct StatementProfile
+        {
+            std::string sql;
+            uint64_t count;
+            Duration total;
+            // Approximated, within 25%
+            Duration p99;
+        };
+
+        Profiler();
+
+        Profiler( const Profiler& ) = delete;
+        Profiler& operator=( const Profiler& ) = delete;
+
+        bool isEnabled() const { return m_enabled.load( std::memory_order_relaxed ); }
+
+        // Called for each executed statement taking at least threshold.
+        // The SQL text has its parameters expanded.
+        void setSlowQueryCallback( SlowQueryCallback callback, Duration threshold );
+
+        // Statements sorted by decreasing total duration
+        std::vector<StatementProfile> snapshot() const;
+        void reset();
+
+        uint64_t prepares() const { return m_prepares; }
+        // Steps which returned a row, or completed a statement
+        uint64_t steps() const { return m_steps; }
+        uint64_t foreignKeyLoads() const { return m_foreignKeyLoads; }
+        // Number of rows loaded, by table name
+        std::map<std::string, uint64_t> rowsLoaded() const;
+
+        void onPrepare()
+        {
+            if ( isEnabled() == true )
+                ++m_prepares;
+        }
+
+        void onForeignKeyLoad()
+        {
+            if ( isEnabled() == true )
+                ++m_foreignKeyLoads;
+        }
+
+        void onRowLoaded( const std::string& table );
+
+    private:
+        // Buckets of durations, with 4 buckets per power of 2
+        static const size_t NbBuckets = 252;
+        static size_t bucket( uint64_t nanoseconds );
+        static uint64_t bucketUpperBound( size_t bucket );
+
+        struct Stats
+        {
+            uint64_t count;
+            uint64_t total;
+            uint64_t max;
+            std::vector<uint64_t> histogram;
+        };
+
+        void setEnabled( bool enabled ) { m_enabled = enabled; }
+        static int trace( unsigned int type, void* data, void* p, void* x );
+        void onStatementStart( sqlite3_stmt* stmt );
+        void onStatement( sqlite3_stmt* stmt, uint64_t nanoseconds );
+
+    private:
+        std::atomic<bool> m_enabled;
+        std::atomic<uint64_t> m_prepares;
+        std::atomic<uint64_t> m_steps;
+        std::atomic<uint64_t> m_foreignKeyLoads;
+        std::unordered_map<std::string, Stats> m_statements;
+        std::map<std::string, uint64_t> m_rowsLoaded;
+        // SQLite only times statements with a millisecond resolution, so
+        // they are timed from their first step instead.
+        std::unordered_map<sqlite3_stmt*, std::chrono::steady_clock::time_point> m_running;
+        SlowQueryCallback m_slowQueryCallback;
+        uint64_t m_slowQueryThreshold;
+        // Statements may run on several threads sharing a connection
+        mutable std::mutex m_lock;
+
+        friend class DBConnection;
+};
+
+}
+
+#endif // PROFILER_HPP
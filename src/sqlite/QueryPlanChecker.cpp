@@ -0,0 +1,112 @@
+/*****************************************************************************
+ * QueryPlanChecker.cpp: Reports full table scans of generated requests
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include "QueryPlanChecker.hpp"
+
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace vsqlite;
+
+QueryPlanChecker::QueryPlanChecker()
+    : m_enabled( false )
+    , m_minRows( 0 )
+{
+}
+
+void
+QueryPlanChecker::enable( Callback callback, int64_t minRows )
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    m_callback = std::move( callback );
+    m_minRows = minRows;
+    m_checked.clear();
+    m_enabled = true;
+}
+
+void
+QueryPlanChecker::disable()
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    m_enabled = false;
+    m_callback = nullptr;
+    m_checked.clear();
+}
+
+void
+QueryPlanChecker::check( sqlite3* db, const std::string& request )
+{
+    Callback callback;
+    int64_t minRows;
+    {
+        std::lock_guard<std::mutex> lock( m_lock );
+        if ( m_enabled == false || m_checked.insert( request ).second == false )
+            return;
+        callback = m_callback;
+        minRows = m_minRows;
+    }
+    sqlite3_stmt* stmt;
+    std::string explain = "EXPLAIN QUERY PLAN " + request;
+    if ( sqlite3_prepare_v2( db, explain.c_str(), -1, &stmt, NULL ) != SQLITE_OK )
+    {
+        std::cerr << "Failed to explain request " << request << ": " << sqlite3_errmsg( db ) << std::endl;
+        return;
+    }
+    std::vector<Scan> scans;
+    while ( sqlite3_step( stmt ) == SQLITE_ROW )
+    {
+        auto detail = (const char*)sqlite3_column_text( stmt, 3 );
+        if ( detail == NULL || strncmp( detail, "SCAN ", 5 ) != 0 )
+            continue;
+        // Older SQLite versions report "SCAN TABLE name"
+        std::string table = detail + 5;
+        if ( table.compare( 0, 6, "TABLE " ) == 0 )
+            table.erase( 0, 6 );
+        table = table.substr( 0, table.find( ' ' ) );
+        // Scans of subqueries or of constant rows aren't table scans
+        if ( table.empty() == true || table[0] == '(' || table == "CONSTANT" )
+            continue;
+        scans.push_back( Scan{ request, table, 0, detail } );
+    }
+    sqlite3_finalize( stmt );
+    for ( auto& s : scans )
+    {
+        s.nbRows = countRows( db, s.table );
+        if ( s.nbRows >= minRows && callback != nullptr )
+            callback( s );
+    }
+}
+
+int64_t
+QueryPlanChecker::countRows( sqlite3* db, const std::string& table )
+{
+    sqlite3_stmt* stmt;
+    std::string request = "SELECT COUNT(*) FROM \"" + table + '"';
+    if ( sqlite3_prepare_v2( db, request.c_str(), -1, &stmt, NULL ) != SQLITE_OK )
+        return 0;
+    int64_t res = 0;
+    if ( sqlite3_step( stmt ) == SQLITE_ROW )
+        res = sqlite3_column_int64( stmt, 0 );
+    sqlite3_finalize( stmt );
+    return res;
+}
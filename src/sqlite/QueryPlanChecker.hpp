@@ -0,0 +1,83 @@
+/*****************************************************************************
+ * QueryPlanChecker.hpp: Reports full table scans of generated requests
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef QUERYPLANCHECKER_HPP
+#define QUERYPLANCHECKER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <sqlite3.h>
+#include <string>
+#include <unordered_set>
+
+namespace vsqlite
+{
+
+/*
+ * Debugging aid running each distinct request of a connection through
+ * EXPLAIN QUERY PLAN, once, and reporting the tables it scans instead of
+ * searching them through an index. Small tables are ignored, since a scan
+ * doesn't cost more than an index lookup for them.
+ */
+class QueryPlanChecker
+{
+    public:
+        struct Scan
+        {
+            std::string request;
+            std::string table;
+            int64_t nbRows;
+            // As reported by EXPLAIN QUERY PLAN
+            std::string detail;
+        };
+
+        typedef std::function<void( const Scan& scan )> Callback;
+
+        QueryPlanChecker();
+
+        QueryPlanChecker( const QueryPlanChecker& ) = delete;
+        QueryPlanChecker& operator=( const QueryPlanChecker& ) = delete;
+
+        // Reports scans of tables holding at least minRows rows
+        void enable( Callback callback, int64_t minRows = 0 );
+        void disable();
+        bool isEnabled() const { return m_enabled.load( std::memory_order_relaxed ); }
+
+        // Checks the request, unless it already was
+        void check( sqlite3* db, const std::string& request );
+
+    private:
+        static int64_t countRows( sqlite3* db, const std::string& table );
+
+    private:
+        std::atomic<bool> m_enabled;
+        Callback m_callback;
+        int64_t m_minRows;
+        std::unordered_set<std::string> m_checked;
+        std::mutex m_lock;
+};
+
+}
+
+#endif // QUERYPLANCHECKER_HPP
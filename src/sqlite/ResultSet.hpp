@@ -0,0 +1,82 @@
+/*****************************************************************************
+ * ResultSet.hpp: Fetched rows, along with the memory they refer to
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef RESULTSET_HPP
+#define RESULTSET_HPP
+
+#include <memory>
+#include <vector>
+
+#include "Arena.hpp"
+
+namespace vsqlite
+{
+
+template <typename T>
+class FetchOperation;
+
+/*
+ * Rows fetched by a FetchOperation. Unlike a plain std::vector<T>, it owns the
+ * arena that TextView columns point to, which is released along with the
+ * rows, in one go.
+ */
+template <typename T>
+class ResultSet
+{
+    public:
+        typedef typename std::vector<T>::iterator iterator;
+        typedef typename std::vector<T>::const_iterator const_iterator;
+
+        ResultSet()
+            : m_arena( new Arena )
+        {
+        }
+
+        ResultSet( ResultSet&& ) = default;
+        ResultSet& operator=( ResultSet&& ) = default;
+        ResultSet( const ResultSet& ) = delete;
+        ResultSet& operator=( const ResultSet& ) = delete;
+
+        iterator begin() { return m_rows.begin(); }
+        iterator end() { return m_rows.end(); }
+        const_iterator begin() const { return m_rows.begin(); }
+        const_iterator end() const { return m_rows.end(); }
+
+        size_t size() const { return m_rows.size(); }
+        bool empty() const { return m_rows.empty(); }
+        T& operator[]( size_t i ) { return m_rows[i]; }
+        const T& operator[]( size_t i ) const { return m_rows[i]; }
+
+        const Arena& arena() const { return *m_arena; }
+
+    private:
+        std::vector<T> m_rows;
+        // Kept on the heap so moving the result set doesn't move the memory
+        // the rows point to.
+        std::unique_ptr<Arena> m_arena;
+
+        friend class FetchOperation<T>;
+};
+
+}
+
+#endif // RESULTSET_HPP
@@ -0,0 +1,123 @@
+/*****************************************************************************
+ * StatementCache.cpp: LRU cache of prepared statements
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include "StatementCache.hpp"
+
+using namespace vsqlite;
+
+constexpr size_t StatementCache::DefaultCapacity;
+
+StatementCache::StatementCache( size_t capacity )
+    : m_db( NULL )
+    , m_capacity( capacity )
+    , m_hits( 0 )
+    , m_misses( 0 )
+{
+}
+
+StatementCache::~StatementCache()
+{
+    reset( NULL );
+}
+
+void
+StatementCache::reset( sqlite3* db )
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    for ( auto& e : m_entries )
+        sqlite3_finalize( e.second );
+    m_entries.clear();
+    m_index.clear();
+    m_db = db;
+}
+
+int
+StatementCache::acquire( const std::string& request, sqlite3_stmt** outStatement, bool* prepared )
+{
+    std::unique_lock<std::mutex> lock( m_lock );
+    auto it = m_index.find( request );
+    if ( it != m_index.end() )
+    {
+        ++m_hits;
+        *outStatement = it->second->second;
+        m_entries.erase( it->second );
+        m_index.erase( it );
+        if ( prepared != NULL )
+            *prepared = false;
+        return SQLITE_OK;
+    }
+    ++m_misses;
+    if ( prepared != NULL )
+        *prepared = true;
+    sqlite3* db = m_db;
+    // Don't block other threads while preparing
+    lock.unlock();
+    return sqlite3_prepare_v2( db, request.c_str(), -1, outStatement, NULL );
+}
+
+void
+StatementCache::release( const std::string& request, sqlite3_stmt* statement )
+{
+    if ( statement == NULL )
+        return;
+    std::lock_guard<std::mutex> lock( m_lock );
+    // Statements that outlived the connection they were prepared for, or
+    // that are a duplicate of an already idle one, are simply dropped.
+    if ( m_capacity == 0 || sqlite3_db_handle( statement ) != m_db ||
+         m_index.find( request ) != m_index.end() )
+    {
+        sqlite3_finalize( statement );
+        return;
+    }
+    sqlite3_reset( statement );
+    sqlite3_clear_bindings( statement );
+    m_entries.emplace_front( request, statement );
+    m_index[request] = m_entries.begin();
+    evict();
+}
+
+void
+StatementCache::setCapacity( size_t capacity )
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    m_capacity = capacity;
+    evict();
+}
+
+size_t
+StatementCache::size() const
+{
+    std::lock_guard<std::mutex> lock( m_lock );
+    return m_entries.size();
+}
+
+void
+StatementCache::evict()
+{
+    while ( m_entries.size() > m_capacity )
+    {
+        auto& e = m_entries.back();
+        sqlite3_finalize( e.second );
+        m_index.erase( e.first );
+        m_entries.pop_back();
+    }
+}
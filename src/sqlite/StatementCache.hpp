@@ -0,0 +1,87 @@
+/*****************************************************************************
+ * StatementCache.hpp: LRU cache of prepared statements
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef STATEMENTCACHE_HPP
+#define STATEMENTCACHE_HPP
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <sqlite3.h>
+#include <string>
+#include <unordered_map>
+
+namespace vsqlite
+{
+
+/*
+ * Keeps idle prepared statements around, indexed by their SQL text.
+ * A statement is removed from the cache while an operation uses it, and
+ * handed back (reset & unbound) once the operation is done with it.
+ */
+class StatementCache
+{
+    public:
+        static constexpr size_t DefaultCapacity = 64;
+
+        StatementCache( size_t capacity = DefaultCapacity );
+        ~StatementCache();
+
+        StatementCache( const StatementCache& ) = delete;
+        StatementCache& operator=( const StatementCache& ) = delete;
+
+        // Finalizes all cached statements and binds the cache to a new connection.
+        void reset( sqlite3* db );
+
+        // Returns a SQLite result code, and a ready to bind statement in outStatement.
+        // prepared, if provided, tells whether the statement had to be prepared.
+        int acquire( const std::string& request, sqlite3_stmt** outStatement, bool* prepared = NULL );
+        void release( const std::string& request, sqlite3_stmt* statement );
+
+        void setCapacity( size_t capacity );
+        size_t capacity() const { return m_capacity; }
+        size_t size() const;
+
+        unsigned int hits() const { return m_hits; }
+        unsigned int misses() const { return m_misses; }
+
+    private:
+        void evict();
+
+    private:
+        typedef std::pair<std::string, sqlite3_stmt*> Entry;
+        typedef std::list<Entry> Entries;
+
+        sqlite3* m_db;
+        size_t m_capacity;
+        // Most recently used statements are kept at the front
+        Entries m_entries;
+        std::unordered_map<std::string, Entries::iterator> m_index;
+        std::atomic<unsigned int> m_hits;
+        std::atomic<unsigned int> m_misses;
+        // A connection, and therefore its cache, may be shared by several threads
+        mutable std::mutex m_lock;
+};
+
+}
+
+#endif // STATEMENTCACHE_HPP
@@ -23,9 +23,15 @@
 #ifndef TABLE_HPP
 #define TABLE_HPP
 
+#include <algorithm>
+#include <functional>
+#include <iterator>
 #include <memory>
+#include <tuple>
+#include <type_traits>
 
 #include "Column.hpp"
+#include "Cursor.hpp"
 #include "DBConnection.hpp"
 #include "Operation.hpp"
 
@@ -33,12 +39,91 @@ namespace vsqlite
 {
 
 template <typename T> class Table;
+template <typename T> class TableSchema;
+
+/*
+ * Raw SQL bringing an existing table to a version, from the previous one.
+ * A table's version is the highest version of its migrations, or 0.
+ * Newly created tables are created up to date and skip all migrations.
+ */
+class Migration
+{
+    public:
+        Migration( int toVersion, std::string request )
+            : m_toVersion( toVersion )
+            , m_request( std::move( request ) )
+        {
+        }
+
+        int toVersion() const { return m_toVersion; }
+        const std::string& request() const { return m_request; }
+
+    private:
+        int m_toVersion;
+        std::string m_request;
+};
 
 class ITableSchema
 {
     public:
         virtual CreateTableOperation create() const = 0;
+        virtual std::vector<CreateIndexOperation> createIndexes() const = 0;
         virtual const std::string& name() const = 0;
+        virtual int version() const = 0;
+        // Sorted by increasing version
+        virtual std::vector<std::shared_ptr<Migration>> migrations() const = 0;
+};
+
+/*
+ * Secondary index over one or more columns of a table.
+ * Columns are resolved against the table schema when the index gets
+ * created, so indexes can be registered before their columns.
+ */
+template <typename T>
+class IndexSchema
+{
+    public:
+        typedef std::function<std::shared_ptr<ColumnSchema<T>>( const TableSchema<T>& )> ColumnResolver;
+
+        IndexSchema( bool unique )
+            : m_unique( unique )
+        {
+        }
+
+        template <typename FIELD>
+        void addColumn( FIELD T::* field )
+        {
+            m_columns.push_back( [field]( const TableSchema<T>& t ) {
+                return t.column( field );
+            } );
+        }
+
+        void addColumn( const std::string& name )
+        {
+            m_columns.push_back( [name]( const TableSchema<T>& t ) {
+                return t.column( name );
+            } );
+        }
+
+        bool isUnique() const { return m_unique; }
+
+        // Returns an empty vector if a column doesn't belong to the table
+        std::vector<std::string> columnNames( const TableSchema<T>& table ) const
+        {
+            std::vector<std::string> names;
+            for ( const auto& resolve : m_columns )
+            {
+                auto c = resolve( table );
+                if ( c == nullptr )
+                    return {};
+                names.push_back( c->name() );
+            }
+            return names;
+        }
+
+    private:
+        bool m_unique;
+        std::vector<ColumnResolver> m_columns;
 };
 
 template <typename T>
@@ -48,15 +133,87 @@ class TableSchema : ITableSchema
         typedef std::shared_ptr<ColumnSchema<T>> ColumnSchemaPtr;
         typedef std::vector<ColumnSchemaPtr> Columns;
 
-        TableSchema(const std::string& name) : m_name(name) {}
+        TableSchema(const std::string& name)
+            : m_name(name)
+            , m_needsArena( false )
+        {
+        }
+
+        virtual ~TableSchema() = default;
 
         virtual CreateTableOperation create() const
         {
             return CreateTableOperation( *this );
         }
 
+        virtual std::vector<CreateIndexOperation> createIndexes() const
+        {
+            std::vector<CreateIndexOperation> res;
+            std::vector<std::string> indexNames;
+            for ( const auto& i : m_indexes )
+            {
+                auto columns = i->columnNames( *this );
+                if ( columns.empty() == true )
+                {
+                    std::cerr << "Ignoring index over an unknown column of " << m_name << std::endl;
+                    continue;
+                }
+                std::string name = m_name;
+                for ( const auto& c : columns )
+                    name += '_' + c;
+                name += i->isUnique() ? "_unique_idx" : "_idx";
+                // Foreign keys are indexed by default, and may be explicitly as well
+                if ( std::find( indexNames.begin(), indexNames.end(), name ) != indexNames.end() )
+                    continue;
+                indexNames.push_back( name );
+                res.emplace_back( m_name, name, columns, i->isUnique() );
+            }
+            return res;
+        }
+
+        virtual int version() const
+        {
+            return m_migrations.empty() ? 0 : m_migrations.back()->toVersion();
+        }
+
+        virtual std::vector<std::shared_ptr<Migration>> migrations() const
+        {
+            return m_migrations;
+        }
+
+        // Loads all the columns of the statement's current row in record
+        virtual void loadRow( sqlite3_stmt* stmt, T& record, Arena* arena ) const
+        {
+            for ( const auto& c : m_columns )
+                c->load( stmt, c->columnIndex(), record, arena );
+        }
+
+        // Binds all the record's columns as the statement parameters.
+        // Returns the first error code, or SQLITE_OK
+        virtual int bindRow( sqlite3_stmt* stmt, const T& record ) const
+        {
+            for ( size_t i = 0; i < m_columns.size(); ++i )
+            {
+                int resultCode = m_columns[i]->bind( stmt, i + 1, record );
+                if ( resultCode != SQLITE_OK )
+                    return resultCode;
+            }
+            return SQLITE_OK;
+        }
+
+        // Marks all the record's columns as matching the database
+        void setClean( T& record ) const
+        {
+            for ( const auto& c : m_columns )
+                c->setClean( record );
+        }
+
         const std::string& name() const { return m_name; }
         const Columns& columns() const { return m_columns; }
+        // Parametrized request, shared by all the inserts in this table
+        const std::string& insertRequest() const { return m_insertRequest; }
+        // Rows with TextView columns can only be fetched in a ResultSet or a Cursor
+        bool needsArena() const { return m_needsArena; }
         PrimaryKeySchema<T>& primaryKey() const { return *m_primaryKey; }
 
         const ColumnSchemaPtr column( const std::string& name ) const
@@ -69,7 +226,48 @@ class TableSchema : ITableSchema
             }
             return nullptr;
         }
+
+        template <typename TYPE>
+        const ColumnSchemaPtr column( Column<T, TYPE> T::* field ) const
+        {
+            if ( isPrimaryKey( field, std::is_integral<TYPE>() ) == true )
+                return m_primaryKey;
+            for ( const auto& c : m_columns )
+            {
+                auto impl = dynamic_cast<const ColumnSchemaImpl<T, TYPE>*>( c.get() );
+                if ( impl != NULL && impl->field() == field )
+                    return c;
+            }
+            return nullptr;
+        }
+
+        template <typename FOREIGNTYPE, typename FOREIGNKEYTYPE>
+        const ColumnSchemaPtr column( ForeignKey<T, FOREIGNTYPE, FOREIGNKEYTYPE> T::* field ) const
+        {
+            for ( const auto& c : m_columns )
+            {
+                auto impl = dynamic_cast<const ForeignKeySchema<T, FOREIGNTYPE, FOREIGNKEYTYPE>*>( c.get() );
+                if ( impl != NULL && impl->field() == field )
+                    return c;
+            }
+            return nullptr;
+        }
+
     private:
+        template <typename TYPE>
+        bool isPrimaryKey( Column<T, TYPE> T::* field, std::true_type ) const
+        {
+            auto pKey = dynamic_cast<const PrimaryKeySchemaImpl<T, TYPE>*>( m_primaryKey.get() );
+            return pKey != NULL && pKey->field() == field;
+        }
+
+        // Only integers can be primary keys
+        template <typename TYPE>
+        bool isPrimaryKey( Column<T, TYPE> T::*, std::false_type ) const
+        {
+            return false;
+        }
+
         template <typename C>
         void appendColumn(std::shared_ptr<C> column)
         {
@@ -77,43 +275,243 @@ class TableSchema : ITableSchema
                            "All table fields must inherit Column<> class");
             column->setColumnIndex( m_columns.size() );
             m_columns.push_back(column);
+            m_needsArena = m_needsArena || column->needsArena();
+            // Columns are named, since migrations may have appended them in
+            // a different order than the one they are declared in
+            std::string names;
+            std::string values;
+            for ( const auto& c : m_columns )
+            {
+                names += ( names.empty() ? "" : "," ) + c->name();
+                values += values.empty() ? "?" : ",?";
+            }
+            m_insertRequest = "INSERT INTO " + m_name + '(' + names + ") VALUES(" + values + ')';
         }
 
-        void appendColumn( std::shared_ptr<PrimaryKeySchema<T>> column )
+        template <typename TYPE>
+        void appendColumn( std::shared_ptr<PrimaryKeySchemaImpl<T, TYPE>> column )
         {
             appendColumn( static_cast<ColumnSchemaPtr>( column ) );
             m_primaryKey = column;
         }
 
+        // Foreign keys are always joined or filtered on, so index them
+        template <typename FOREIGNTYPE, typename FOREIGNKEYTYPE>
+        void appendColumn( std::shared_ptr<ForeignKeySchema<T, FOREIGNTYPE, FOREIGNKEYTYPE>> column )
+        {
+            appendColumn( static_cast<ColumnSchemaPtr>( column ) );
+            auto index = std::make_shared<IndexSchema<T>>( false );
+            index->addColumn( column->name() );
+            m_indexes.push_back( index );
+        }
+
+        void appendColumn( std::shared_ptr<IndexSchema<T>> index )
+        {
+            m_indexes.push_back( index );
+        }
+
+        void appendColumn( std::shared_ptr<Migration> migration )
+        {
+            auto it = std::upper_bound( m_migrations.begin(), m_migrations.end(), migration,
+                                        []( const std::shared_ptr<Migration>& a, const std::shared_ptr<Migration>& b ) {
+                return a->toVersion() < b->toVersion();
+            } );
+            m_migrations.insert( it, migration );
+        }
+
     private:
         std::string m_name;
         std::shared_ptr<PrimaryKeySchema<T>> m_primaryKey;
         std::vector<ColumnSchemaPtr> m_columns;
+        std::vector<std::shared_ptr<IndexSchema<T>>> m_indexes;
+        std::vector<std::shared_ptr<Migration>> m_migrations;
+        std::string m_insertRequest;
+        bool m_needsArena;
 
         friend class Table<T>;
 };
 
-template <typename CLASS>
-class Table
+/*
+ * Unrolls the per column operations over a tuple of column schemas at compile
+ * time. Columns are called through their concrete type, which spares a
+ * virtual call per column and per row.
+ */
+template <typename T, size_t I, size_t N>
+struct ColumnsDispatcher
+{
+    template <typename TUPLE>
+    static void load( const TUPLE& columns, sqlite3_stmt* stmt, T& record, Arena* arena )
+    {
+        loadColumn( std::get<I>( columns ), stmt, record, arena );
+        ColumnsDispatcher<T, I + 1, N>::load( columns, stmt, record, arena );
+    }
+
+    template <typename TUPLE>
+    static int bind( const TUPLE& columns, sqlite3_stmt* stmt, const T& record )
+    {
+        int resultCode = bindColumn( std::get<I>( columns ), stmt, record );
+        if ( resultCode != SQLITE_OK )
+            return resultCode;
+        return ColumnsDispatcher<T, I + 1, N>::bind( columns, stmt, record );
+    }
+
+private:
+    template <typename C>
+    static void loadColumn( const std::shared_ptr<C>& c, sqlite3_stmt* stmt, T& record, Arena* arena )
+    {
+        c->C::load( stmt, c->columnIndex(), record, arena );
+    }
+
+    template <typename C>
+    static int bindColumn( const std::shared_ptr<C>& c, sqlite3_stmt* stmt, const T& record )
+    {
+        return c->C::bind( stmt, c->columnIndex() + 1, record );
+    }
+
+    // Indexes and migrations are registered along with the columns, but
+    // aren't part of rows
+    static void loadColumn( const std::shared_ptr<IndexSchema<T>>&, sqlite3_stmt*, T&, Arena* )
+    {
+    }
+
+    static int bindColumn( const std::shared_ptr<IndexSchema<T>>&, sqlite3_stmt*, const T& )
+    {
+        return SQLITE_OK;
+    }
+
+    static void loadColumn( const std::shared_ptr<Migration>&, sqlite3_stmt*, T&, Arena* )
+    {
+    }
+
+    static int bindColumn( const std::shared_ptr<Migration>&, sqlite3_stmt*, const T& )
+    {
+        return SQLITE_OK;
+    }
+};
+
+template <typename T, size_t N>
+struct ColumnsDispatcher<T, N, N>
+{
+    template <typename TUPLE>
+    static void load( const TUPLE&, sqlite3_stmt*, T&, Arena* )
+    {
+    }
+
+    template <typename TUPLE>
+    static int bind( const TUPLE&, sqlite3_stmt*, const T& )
+    {
+        return SQLITE_OK;
+    }
+};
+
+/*
+ * Table schema which also knows the concrete type of all its columns, as
+ * created by Table<T>::Register. columns() still provides a runtime view of
+ * the same columns for introspection.
+ */
+template <typename T, typename... COLUMNS>
+class TableSchemaImpl : public TableSchema<T>
 {
     public:
-        Table()
+        TableSchemaImpl( const std::string& name, const COLUMNS&... columns )
+            : TableSchema<T>( name )
+            , m_typedColumns( columns... )
         {
-            const auto& columns = CLASS::schema->columns();
-            for ( auto& column : columns )
-            {
-                column->setSchema( static_cast<CLASS*>( this ) );
-            }
         }
 
+        virtual void loadRow( sqlite3_stmt* stmt, T& record, Arena* arena ) const
+        {
+            ColumnsDispatcher<T, 0, sizeof...(COLUMNS)>::load( m_typedColumns, stmt, record, arena );
+        }
+
+        virtual int bindRow( sqlite3_stmt* stmt, const T& record ) const
+        {
+            return ColumnsDispatcher<T, 0, sizeof...(COLUMNS)>::bind( m_typedColumns, stmt, record );
+        }
+
+    private:
+        std::tuple<COLUMNS...> m_typedColumns;
+};
+
+template <typename CLASS>
+class Table
+{
+    public:
         InsertOperation<CLASS> insert()
         {
             return InsertOperation<CLASS>( static_cast<CLASS&>( *this ) );
         }
 
-        static FetchOperation<CLASS> fetch()
+        template <typename ITERATOR>
+        static InsertManyOperation<CLASS, ITERATOR> insert( ITERATOR begin, ITERATOR end )
+        {
+            return InsertManyOperation<CLASS, ITERATOR>( begin, end );
+        }
+
+        template <typename RANGE>
+        static auto insert( RANGE& records ) -> InsertManyOperation<CLASS, decltype( std::begin( records ) )>
+        {
+            return insert( std::begin( records ), std::end( records ) );
+        }
+
+        // Inserts the record, or updates the row it conflicts with on the
+        // given columns. UpsertOperation::update() restricts the columns which
+        // get overwritten. Either way, the row's primary key is stored in the record.
+        template <typename... FIELDS>
+        static UpsertOperation<CLASS, CLASS*> upsert( CLASS& record, FIELDS CLASS::*... fields )
+        {
+            return UpsertOperation<CLASS, CLASS*>( &record, &record + 1, columns( fields... ), true );
+        }
+
+        template <typename RANGE, typename... FIELDS>
+        static auto upsert( RANGE& records, FIELDS CLASS::*... fields )
+                -> UpsertOperation<CLASS, decltype( std::begin( records ) )>
+        {
+            return UpsertOperation<CLASS, decltype( std::begin( records ) )>(
+                        std::begin( records ), std::end( records ), columns( fields... ), true );
+        }
+
+        // Inserts the record, unless it conflicts with an existing row on the
+        // given columns, in which case that row's primary key is stored in the record.
+        template <typename... FIELDS>
+        static UpsertOperation<CLASS, CLASS*> findOrCreate( CLASS& record, FIELDS CLASS::*... fields )
+        {
+            return UpsertOperation<CLASS, CLASS*>( &record, &record + 1, columns( fields... ), false );
+        }
+
+        template <typename RANGE, typename... FIELDS>
+        static auto findOrCreate( RANGE& records, FIELDS CLASS::*... fields )
+                -> UpsertOperation<CLASS, decltype( std::begin( records ) )>
+        {
+            return UpsertOperation<CLASS, decltype( std::begin( records ) )>(
+                        std::begin( records ), std::end( records ), columns( fields... ), false );
+        }
+
+        // Writes the columns which were modified since the row was fetched,
+        // inserted or saved.
+        UpdateOperation<CLASS> save()
+        {
+            return UpdateOperation<CLASS>( static_cast<CLASS&>( *this ) );
+        }
+
+        // Updates all the rows matching a where clause, if any
+        static UpdateOperation<CLASS> update()
+        {
+            return UpdateOperation<CLASS>();
+        }
+
+        // Removes all the rows matching a where clause, if any
+        static DeleteOperation<CLASS> remove()
+        {
+            return DeleteOperation<CLASS>();
+        }
+
+        // Fetches the given columns only, or all of them if none is provided.
+        // Other columns of the fetched rows are left null.
+        template <typename... FIELDS>
+        static FetchOperation<CLASS> fetch( FIELDS CLASS::*... fields )
         {
-            return FetchOperation<CLASS>( "SELECT * FROM " + CLASS::schema->name() );
+            return FetchOperation<CLASS>().select( fields... );
         }
 
         static const PrimaryKeySchema<CLASS>& primaryKey()
@@ -146,7 +544,7 @@ class Table
         template <typename... COLUMNS>
         static const TableSchema<CLASS>* Register(const std::string& name, COLUMNS... columns)
         {
-            auto t = new TableSchema<CLASS>( name );
+            auto t = new TableSchemaImpl<CLASS, COLUMNS...>( name, columns... );
             Register(t, columns...);
             DBConnection::registerTableSchema( t );
             return t;
@@ -158,9 +556,10 @@ class Table
             return std::make_shared<ColumnSchemaImpl<CLASS, TYPE>>(attributePtr, name);
         }
 
-        static std::shared_ptr<PrimaryKeySchema<CLASS>> createPrimaryKey(Column<CLASS, int> CLASS::* attributePtr, const std::string& name)
+        template <typename TYPE>
+        static std::shared_ptr<PrimaryKeySchemaImpl<CLASS, TYPE>> createPrimaryKey(Column<CLASS, TYPE> CLASS::* attributePtr, const std::string& name)
         {
-            return std::make_shared<PrimaryKeySchema<CLASS>>(attributePtr, name);
+            return std::make_shared<PrimaryKeySchemaImpl<CLASS, TYPE>>(attributePtr, name);
         }
 
         template <typename FOREIGNTYPE, typename FOREIGNKEYTYPE>
@@ -168,6 +567,45 @@ class Table
         {
             return std::make_shared<ForeignKeySchema<CLASS, FOREIGNTYPE, FOREIGNKEYTYPE>>(attributePtr, name);
         }
+
+        template <typename... FIELDS>
+        static std::shared_ptr<IndexSchema<CLASS>> createIndex( FIELDS CLASS::*... fields )
+        {
+            return createIndex( false, fields... );
+        }
+
+        template <typename... FIELDS>
+        static std::shared_ptr<IndexSchema<CLASS>> createUniqueIndex( FIELDS CLASS::*... fields )
+        {
+            return createIndex( true, fields... );
+        }
+
+        // Registers the SQL updating existing tables to toVersion, such as
+        // "ALTER TABLE ... ADD COLUMN ...", along with the new column.
+        static std::shared_ptr<Migration> createMigration( int toVersion, const std::string& request )
+        {
+            return std::make_shared<Migration>( toVersion, request );
+        }
+
+    private:
+        template <typename... FIELDS>
+        static std::vector<std::shared_ptr<ColumnSchema<CLASS>>> columns( FIELDS CLASS::*... fields )
+        {
+            std::vector<std::shared_ptr<ColumnSchema<CLASS>>> res = { CLASS::schema->column( fields )... };
+            // Unregistered columns are ignored
+            res.erase( std::remove( res.begin(), res.end(), nullptr ), res.end() );
+            return res;
+        }
+
+        template <typename... FIELDS>
+        static std::shared_ptr<IndexSchema<CLASS>> createIndex( bool unique, FIELDS CLASS::*... fields )
+        {
+            static_assert( sizeof...(FIELDS) > 0, "An index needs at least one column" );
+            auto index = std::make_shared<IndexSchema<CLASS>>( unique );
+            int expand[] = { ( index->addColumn( fields ), 0 )... };
+            (void)expand;
+            return index;
+        }
 };
 
 }
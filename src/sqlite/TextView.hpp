@@ -0,0 +1,113 @@
+/*****************************************************************************
+ * TextView.hpp: Non owning text column values
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef TEXTVIEW_HPP
+#define TEXTVIEW_HPP
+
+#include <cassert>
+#include <cstring>
+#include <sqlite3.h>
+#include <string>
+
+#include "Arena.hpp"
+#include "Tools.hpp"
+
+namespace vsqlite
+{
+
+/*
+ * Read only view over a text value. When loaded from the database, the bytes
+ * live in the arena of the ResultSet or Cursor the row was fetched through,
+ * so the view must not outlive it.
+ */
+class TextView
+{
+    public:
+        TextView()
+            : m_data( "" )
+            , m_size( 0 )
+        {
+        }
+
+        TextView( const char* data, size_t size )
+            : m_data( data )
+            , m_size( size )
+        {
+        }
+
+        TextView( const char* str )
+            : m_data( str )
+            , m_size( strlen( str ) )
+        {
+        }
+
+        TextView( const std::string& str )
+            : m_data( str.c_str() )
+            , m_size( str.size() )
+        {
+        }
+
+        const char* data() const { return m_data; }
+        size_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+
+        std::string str() const { return std::string( m_data, m_size ); }
+
+        bool operator==( const TextView& v ) const
+        {
+            return m_size == v.m_size && memcmp( m_data, v.m_data, m_size ) == 0;
+        }
+
+        bool operator!=( const TextView& v ) const
+        {
+            return !( *this == v );
+        }
+
+    private:
+        const char* m_data;
+        size_t m_size;
+};
+
+template <>
+struct Traits<TextView>
+{
+    static constexpr const char* name = "VARCHAR (255)";
+
+    static TextView Load( sqlite3_stmt* stmt, int index, Arena* arena )
+    {
+        assert( arena != NULL && "TextView columns must be fetched through a ResultSet or a Cursor" );
+        if ( arena == NULL )
+            return TextView();
+        const void* text = sqlite3_column_text( stmt, index );
+        size_t size = sqlite3_column_bytes( stmt, index );
+        return TextView( arena->copy( text, size ), size );
+    }
+
+    static int Bind( sqlite3_stmt* stmt, int index, const TextView& value )
+    {
+        return sqlite3_bind_text( stmt, index, value.data(), value.size(), SQLITE_STATIC );
+    }
+};
+
+}
+
+#endif // TEXTVIEW_HPP
@@ -23,9 +23,16 @@
 #ifndef TOOLS_HPP
 #define TOOLS_HPP
 
+#include <cstdint>
+#include <sqlite3.h>
+#include <string>
+#include <vector>
+
 namespace vsqlite
 {
 
+class Arena;
+
 template <template <typename...> class REF, typename TESTED>
 struct is_instantiation_of : std::false_type
 {
@@ -45,18 +52,81 @@ template <>
 struct Traits<int>
 {
     static constexpr const char* name = "INTEGER";
-    static constexpr const bool need_escape = false;
-    static constexpr int (* const Load)(sqlite3_stmt*, int) = &sqlite3_column_int;
+
+    static int Load( sqlite3_stmt* stmt, int index, Arena* )
+    {
+        return sqlite3_column_int( stmt, index );
+    }
+
     static constexpr int (* const Bind)(sqlite3_stmt*, int, int ) = &sqlite3_bind_int;
 };
 
+template <>
+struct Traits<int64_t>
+{
+    static constexpr const char* name = "INTEGER";
+
+    static int64_t Load( sqlite3_stmt* stmt, int index, Arena* )
+    {
+        return sqlite3_column_int64( stmt, index );
+    }
+
+    static int Bind( sqlite3_stmt* stmt, int index, int64_t value )
+    {
+        return sqlite3_bind_int64( stmt, index, value );
+    }
+};
+
+template <>
+struct Traits<double>
+{
+    static constexpr const char* name = "REAL";
+
+    static double Load( sqlite3_stmt* stmt, int index, Arena* )
+    {
+        return sqlite3_column_double( stmt, index );
+    }
+
+    static constexpr int (* const Bind)(sqlite3_stmt*, int, double ) = &sqlite3_bind_double;
+};
+
 template <>
 struct Traits<std::string>
 {
     static constexpr const char* name = "VARCHAR (255)";
-    static constexpr const bool need_escape = true;
-    static constexpr const unsigned char* (* const Load)(sqlite3_stmt*, int) = &sqlite3_column_text;
-    static constexpr int (* const Bind)(sqlite3_stmt*, int, const char*, int, void(*)(void*) ) = &sqlite3_bind_text;
+
+    static std::string Load( sqlite3_stmt* stmt, int index, Arena* )
+    {
+        return std::string( (const char*)sqlite3_column_text( stmt, index ),
+                            sqlite3_column_bytes( stmt, index ) );
+    }
+
+    // Records are bound by reference, and outlive the statement execution:
+    // there is no need for SQLite to copy their values.
+    static int Bind( sqlite3_stmt* stmt, int index, const std::string& value )
+    {
+        return sqlite3_bind_text( stmt, index, value.c_str(), value.size(), SQLITE_STATIC );
+    }
+};
+
+template <>
+struct Traits<std::vector<uint8_t>>
+{
+    static constexpr const char* name = "BLOB";
+
+    static std::vector<uint8_t> Load( sqlite3_stmt* stmt, int index, Arena* )
+    {
+        auto data = (const uint8_t*)sqlite3_column_blob( stmt, index );
+        return std::vector<uint8_t>( data, data + sqlite3_column_bytes( stmt, index ) );
+    }
+
+    static int Bind( sqlite3_stmt* stmt, int index, const std::vector<uint8_t>& value )
+    {
+        // A NULL pointer, as returned by an empty vector's data(), binds NULL
+        if ( value.empty() == true )
+            return sqlite3_bind_zeroblob( stmt, index, 0 );
+        return sqlite3_bind_blob( stmt, index, value.data(), value.size(), SQLITE_STATIC );
+    }
 };
 
 }
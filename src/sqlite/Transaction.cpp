@@ -0,0 +1,114 @@
+/*****************************************************************************
+ * Transaction.cpp: RAII transaction & savepoint scope
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include "Transaction.hpp"
+
+#include <atomic>
+#include <iostream>
+
+using namespace vsqlite;
+
+static bool exec( sqlite3* db, const std::string& request )
+{
+    int resultCode = sqlite3_exec( db, request.c_str(), NULL, NULL, NULL );
+    if ( resultCode != SQLITE_OK )
+    {
+        std::cerr << "Failed to execute request " << request << '\n'
+                  << "Error code: " << resultCode << '(' <<
+                     sqlite3_errmsg( db ) << ')' << std::endl;
+        return false;
+    }
+    return true;
+}
+
+Transaction::Transaction( sqlite3* db, Mode mode )
+    : m_db( db )
+{
+    if ( sqlite3_get_autocommit( db ) == 0 )
+    {
+        static std::atomic<unsigned int> savepointId( 0 );
+        m_savepoint = "vsqlite_sp" + std::to_string( ++savepointId );
+        if ( exec( db, "SAVEPOINT " + m_savepoint ) == false )
+            m_db = NULL;
+        return;
+    }
+    const char* request;
+    switch ( mode )
+    {
+        case Mode::Immediate:
+            request = "BEGIN IMMEDIATE";
+            break;
+        case Mode::Exclusive:
+            request = "BEGIN EXCLUSIVE";
+            break;
+        default:
+            request = "BEGIN DEFERRED";
+            break;
+    }
+    if ( exec( db, request ) == false )
+        m_db = NULL;
+}
+
+Transaction::Transaction( Transaction&& t )
+    : m_db( t.m_db )
+    , m_savepoint( std::move( t.m_savepoint ) )
+{
+    t.m_db = NULL;
+}
+
+Transaction::~Transaction()
+{
+    rollback();
+}
+
+bool
+Transaction::commit()
+{
+    if ( m_db == NULL )
+        return false;
+    if ( isNested() )
+    {
+        if ( exec( m_db, "RELEASE " + m_savepoint ) == false )
+            return false;
+    }
+    else if ( exec( m_db, "COMMIT" ) == false )
+        return false;
+    m_db = NULL;
+    return true;
+}
+
+void
+Transaction::rollback()
+{
+    if ( m_db == NULL )
+        return;
+    if ( isNested() )
+    {
+        // Rolling back to a savepoint leaves it on the stack
+        exec( m_db, "ROLLBACK TO " + m_savepoint );
+        exec( m_db, "RELEASE " + m_savepoint );
+    }
+    // Some errors roll the transaction back automatically
+    else if ( sqlite3_get_autocommit( m_db ) == 0 )
+        exec( m_db, "ROLLBACK" );
+    m_db = NULL;
+}
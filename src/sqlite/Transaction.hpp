@@ -0,0 +1,70 @@
+/*****************************************************************************
+ * Transaction.hpp: RAII transaction & savepoint scope
+ *****************************************************************************
+ * Copyright (C) 2008-2014 VideoLAN
+ *
+ * Authors: Hugo Beauzée-Luyssen <hugo@beauzee.fr>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef TRANSACTION_HPP
+#define TRANSACTION_HPP
+
+#include <sqlite3.h>
+#include <string>
+
+namespace vsqlite
+{
+
+/*
+ * Opens a transaction for the lifetime of the object. Unless commit() gets
+ * called, the transaction is rolled back upon destruction.
+ * When a transaction is already in progress on the connection, the scope is
+ * mapped to a SAVEPOINT instead, so transactions can be nested.
+ */
+class Transaction
+{
+    public:
+        enum class Mode
+        {
+            Deferred,
+            Immediate,
+            Exclusive,
+        };
+
+        Transaction( sqlite3* db, Mode mode = Mode::Deferred );
+        ~Transaction();
+
+        Transaction( const Transaction& ) = delete;
+        Transaction& operator=( const Transaction& ) = delete;
+        Transaction( Transaction&& t );
+
+        bool commit();
+        void rollback();
+
+        // Returns false if the transaction couldn't be started
+        bool isValid() const { return m_db != NULL; }
+        bool isNested() const { return m_savepoint.empty() == false; }
+
+    private:
+        sqlite3* m_db;
+        // Name of the savepoint, if this transaction is nested
+        std::string m_savepoint;
+};
+
+}
+
+#endif // TRANSACTION_HPP
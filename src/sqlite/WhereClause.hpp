@@ -23,31 +23,169 @@
 #ifndef WHERECLAUSE_HPP
 #define WHERECLAUSE_HPP
 
-#include <functional>
+#include <cstdint>
 #include <iostream>
+#include <sqlite3.h>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "TextView.hpp"
 
 namespace vsqlite
 {
 
+/*
+ * Value bound to a predicate parameter
+ */
+class Value
+{
+    public:
+        enum class Type
+        {
+            Null,
+            Integer,
+            Real,
+            Text,
+            Blob,
+        };
+
+        Value()
+            : m_type( Type::Null )
+            , m_integer( 0 )
+        {
+        }
+
+        template <typename V, typename std::enable_if<std::is_integral<V>::value, int>::type = 0>
+        Value( V value )
+            : m_type( Type::Integer )
+            , m_integer( value )
+        {
+        }
+
+        template <typename V, typename std::enable_if<std::is_floating_point<V>::value, int>::type = 0>
+        Value( V value )
+            : m_type( Type::Real )
+            , m_real( value )
+        {
+        }
+
+        Value( std::string value )
+            : m_type( Type::Text )
+            , m_integer( 0 )
+            , m_text( std::move( value ) )
+        {
+        }
+
+        Value( const char* value )
+            : Value( std::string( value ) )
+        {
+        }
+
+        Value( const TextView& value )
+            : Value( value.str() )
+        {
+        }
+
+        Value( const std::vector<uint8_t>& value )
+            : m_type( Type::Blob )
+            , m_integer( 0 )
+            , m_text( value.begin(), value.end() )
+        {
+        }
+
+        Type type() const { return m_type; }
+
+        int bind( sqlite3_stmt* stmt, int index ) const
+        {
+            switch ( m_type )
+            {
+                case Type::Integer:
+                    return sqlite3_bind_int64( stmt, index, m_integer );
+                case Type::Real:
+                    return sqlite3_bind_double( stmt, index, m_real );
+                case Type::Text:
+                    return sqlite3_bind_text( stmt, index, m_text.c_str(), m_text.size(), SQLITE_TRANSIENT );
+                case Type::Blob:
+                    return sqlite3_bind_blob( stmt, index, m_text.data(), m_text.size(), SQLITE_TRANSIENT );
+                default:
+                    return sqlite3_bind_null( stmt, index );
+            }
+        }
+
+    private:
+        Type m_type;
+        union
+        {
+            int64_t m_integer;
+            double m_real;
+        };
+        // Text or blob bytes
+        std::string m_text;
+};
+
+/*
+ * A SQL condition, along with the values of its parameters.
+ * Predicates can be combined with &&, || and !
+ */
 class Predicate
 {
     public:
-        Predicate( const std::string& fieldName, std::function<int(sqlite3_stmt*, int)> bind )
-            : m_fieldName( fieldName )
-            , m_bind( bind )
+        Predicate( std::string sql, std::vector<Value> values )
+            : m_sql( std::move( sql ) )
+            , m_values( std::move( values ) )
+        {
+        }
+
+        Predicate( std::string sql, Value value )
+            : m_sql( std::move( sql ) )
         {
+            m_values.push_back( std::move( value ) );
         }
 
-        Predicate( Predicate&& p ) = default;
-        const std::string& fieldName() const { return m_fieldName; }
-        int bind( sqlite3_stmt* stmt, int index )
+        const std::string& sql() const { return m_sql; }
+        const std::vector<Value>& values() const { return m_values; }
+
+        // Binds the predicate's parameters, starting at the given index,
+        // which is updated to the next parameter to bind.
+        int bind( sqlite3_stmt* stmt, int& index ) const
         {
-            return m_bind(stmt, index);
+            for ( const auto& v : m_values )
+            {
+                int resultCode = v.bind( stmt, index++ );
+                if ( resultCode != SQLITE_OK )
+                    return resultCode;
+            }
+            return SQLITE_OK;
         }
 
     private:
-        std::string m_fieldName;
-        std::function<int(sqlite3_stmt*, int)> m_bind;
+        static Predicate combine( Predicate&& lhs, Predicate&& rhs, const char* op )
+        {
+            auto values = std::move( lhs.m_values );
+            values.insert( values.end(), std::make_move_iterator( rhs.m_values.begin() ),
+                           std::make_move_iterator( rhs.m_values.end() ) );
+            return Predicate( '(' + lhs.m_sql + op + rhs.m_sql + ')', std::move( values ) );
+        }
+
+        friend Predicate operator&&( Predicate lhs, Predicate rhs )
+        {
+            return combine( std::move( lhs ), std::move( rhs ), " AND " );
+        }
+
+        friend Predicate operator||( Predicate lhs, Predicate rhs )
+        {
+            return combine( std::move( lhs ), std::move( rhs ), " OR " );
+        }
+
+        friend Predicate operator!( Predicate p )
+        {
+            return Predicate( "NOT (" + p.m_sql + ')', std::move( p.m_values ) );
+        }
+
+    private:
+        std::string m_sql;
+        std::vector<Value> m_values;
 };
 
 class WhereClause
@@ -67,21 +205,32 @@ class WhereClause
         {
             if ( m_predicates.empty() )
                 return {};
-            std::string res = " WHERE 1=1";
-            for ( auto& p : m_predicates )
-                res += " AND " + p.fieldName() + " == ?";
+            std::string res = " WHERE ";
+            for ( size_t i = 0; i < m_predicates.size(); ++i )
+            {
+                if ( i > 0 )
+                    res += " AND ";
+                res += m_predicates[i].sql();
+            }
             return res;
         }
 
         bool bind( sqlite3_stmt* statement )
         {
             int bindIndex = 1;
+            return bind( statement, bindIndex );
+        }
+
+        // Binds the predicates' parameters, starting at the given index,
+        // which is updated to the next parameter to bind.
+        bool bind( sqlite3_stmt* statement, int& bindIndex )
+        {
             for ( auto& p : m_predicates )
             {
-                int resultCode = p.bind( statement, bindIndex++ );
+                int resultCode = p.bind( statement, bindIndex );
                 if ( resultCode != SQLITE_OK )
                 {
-                    std::cerr << "Failed to bind predicate " << p.fieldName()
+                    std::cerr << "Failed to bind predicate " << p.sql()
                               << ". Error code #" << resultCode<< std::endl;
                     return false;
                 }
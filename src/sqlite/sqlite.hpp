@@ -33,10 +33,21 @@
 
 // Order is important.
 #include "Tools.hpp"
+#include "Arena.hpp"
+#include "TextView.hpp"
 #include "WhereClause.hpp"
+#include "ConnectionOptions.hpp"
+#include "IdentityMap.hpp"
+#include "Profiler.hpp"
+#include "QueryPlanChecker.hpp"
+#include "StatementCache.hpp"
+#include "Transaction.hpp"
 #include "Column.hpp"
+#include "ResultSet.hpp"
 #include "Operation.hpp"
+#include "Cursor.hpp"
 #include "Table.hpp"
 #include "DBConnection.hpp"
+#include "ConnectionPool.hpp"
 
 #endif // SQLITE_HPP
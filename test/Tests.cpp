@@ -21,7 +21,9 @@
  *****************************************************************************/
 
 #include "gtest/gtest.h"
+#include <algorithm>
 #include <string>
+#include <thread>
 
 #include "sqlite/sqlite.hpp"
 #include "sqlite/Table.hpp"
@@ -35,9 +37,10 @@ class ForeignTable : public vsqlite::Table<ForeignTable>
         ColumnAttribute<std::string> value;
 };
 
-const auto* ForeignTable::schema = ForeignTable::Register("ForeignTable",
+const vsqlite::TableSchema<ForeignTable>* ForeignTable::schema = ForeignTable::Register("ForeignTable",
                                                           createPrimaryKey(&ForeignTable::id, "id"),
-                                                          createField(&ForeignTable::value, "value"));
+                                                          createField(&ForeignTable::value, "value"),
+                                                          createUniqueIndex(&ForeignTable::value));
 
 class TestTable : public vsqlite::Table<TestTable>
 {
@@ -51,13 +54,50 @@ class TestTable : public vsqlite::Table<TestTable>
         ForeignKeyAttribute<ForeignTable, int> foreignValue;
 };
 
-const auto* TestTable::schema = TestTable::Register("TestTable",
+const vsqlite::TableSchema<TestTable>* TestTable::schema = TestTable::Register("TestTable",
                                           createPrimaryKey(&TestTable::id, "id"),
                                           createField(&TestTable::someText, "text"),
                                           createField(&TestTable::moreText, "otherField"),
-                                          createForeignKey(&TestTable::foreignValue, "foreignKey" ) );
+                                          createForeignKey(&TestTable::foreignValue, "foreignKey" ),
+                                          createIndex(&TestTable::moreText) );
 
 
+class ViewTable : public vsqlite::Table<ViewTable>
+{
+    public:
+        static const vsqlite::TableSchema<ViewTable>* schema;
+
+        ColumnAttribute<int> id;
+        ColumnAttribute<vsqlite::TextView> title;
+};
+
+const vsqlite::TableSchema<ViewTable>* ViewTable::schema = ViewTable::Register("ViewTable",
+                                          createPrimaryKey(&ViewTable::id, "id"),
+                                          createField(&ViewTable::title, "title"));
+
+class MediaTable : public vsqlite::Table<MediaTable>
+{
+    public:
+        static const vsqlite::TableSchema<MediaTable>* schema;
+
+        ColumnAttribute<int64_t> id;
+        ColumnAttribute<double> rating;
+        ColumnAttribute<std::vector<uint8_t>> thumbnail;
+};
+
+const vsqlite::TableSchema<MediaTable>* MediaTable::schema = MediaTable::Register("MediaTable",
+                                          createPrimaryKey(&MediaTable::id, "id"),
+                                          createField(&MediaTable::rating, "rating"),
+                                          createField(&MediaTable::thumbnail, "thumbnail"),
+                                          createMigration(1, "ALTER TABLE MediaTable ADD COLUMN rating REAL"));
+
+// Rows shouldn't carry anything but their columns' values
+static_assert( sizeof( vsqlite::Column<ForeignTable, int> ) == 2 * sizeof( int ),
+               "Unexpected column size" );
+static_assert( sizeof( ForeignTable ) == sizeof( vsqlite::Column<ForeignTable, int> ) +
+                                         sizeof( vsqlite::Column<ForeignTable, std::string> ),
+               "Unexpected row size" );
+
 static vsqlite::DBConnection* conn;
 
 class Sqlite : public testing::Test
@@ -121,6 +161,19 @@ TEST_F( Sqlite, InsertOne )
     sqlite3_finalize( outHandle );
 }
 
+TEST_F( Sqlite, InsertEscapedText )
+{
+    TestTable t;
+    t.someText = "sea \"otter\"";
+    t.moreText = "it's a 'quoted' value";
+    bool res = t.insert();
+    ASSERT_TRUE( res );
+
+    TestTable t2 = TestTable::fetch().where( TestTable::primaryKey() == t.id );
+    ASSERT_EQ( t.someText, t2.someText );
+    ASSERT_EQ( t.moreText, t2.moreText );
+}
+
 TEST_F( Sqlite, LoadAll )
 {
     TestTable ts[10];
@@ -145,6 +198,124 @@ TEST_F( Sqlite, LoadAll )
     }
 }
 
+TEST_F( Sqlite, InsertMany )
+{
+    std::vector<TestTable> ts( 100 );
+    for ( size_t i = 0; i < ts.size(); ++i )
+    {
+        ts[i].someText = "bulk" + std::to_string( i );
+        ts[i].moreText = "insert";
+    }
+    bool res = TestTable::insert( ts );
+    ASSERT_TRUE( res );
+
+    std::vector<TestTable> t2s = TestTable::fetch();
+    ASSERT_EQ( ts.size(), t2s.size() );
+    for ( size_t i = 0; i < ts.size(); ++i )
+    {
+        ASSERT_EQ( (int)i + 1, ts[i].id );
+        ASSERT_EQ( ts[i].id, t2s[i].id );
+        ASSERT_EQ( ts[i].someText, t2s[i].someText );
+    }
+}
+
+TEST_F( Sqlite, Transaction )
+{
+    {
+        auto t = conn->newTransaction();
+        ASSERT_TRUE( t.isValid() );
+        ASSERT_FALSE( t.isNested() );
+        TestTable row;
+        row.someText = "rolled back";
+        bool res = row.insert();
+        ASSERT_TRUE( res );
+    }
+    std::vector<TestTable> t2s = TestTable::fetch();
+    ASSERT_EQ( 0u, t2s.size() );
+
+    {
+        auto t = conn->newTransaction( vsqlite::Transaction::Mode::Immediate );
+        TestTable row;
+        row.someText = "committed";
+        bool res = row.insert();
+        ASSERT_TRUE( res );
+        {
+            auto nested = conn->newTransaction();
+            ASSERT_TRUE( nested.isNested() );
+            TestTable row2;
+            row2.someText = "rolled back";
+            res = row2.insert();
+            ASSERT_TRUE( res );
+        }
+        ASSERT_TRUE( t.commit() );
+    }
+    t2s = TestTable::fetch();
+    ASSERT_EQ( 1u, t2s.size() );
+    ASSERT_EQ( t2s[0].someText, "committed" );
+}
+
+TEST_F( Sqlite, Cursor )
+{
+    std::vector<TestTable> ts( 10 );
+    for ( size_t i = 0; i < ts.size(); ++i )
+        ts[i].someText = "cursor" + std::to_string( i );
+    bool res = TestTable::insert( ts );
+    ASSERT_TRUE( res );
+
+    size_t i = 0;
+    for ( const auto& t : TestTable::fetch().cursor() )
+    {
+        ASSERT_EQ( ts[i].id, t.id );
+        ASSERT_EQ( ts[i].someText, t.someText );
+        ASSERT_TRUE( t.moreText.isNull() );
+        ++i;
+    }
+    ASSERT_EQ( ts.size(), i );
+
+    auto empty = TestTable::fetch().where( TestTable::primaryKey() == 0 ).cursor();
+    ASSERT_TRUE( empty.begin() == empty.end() );
+}
+
+TEST_F( Sqlite, TextView )
+{
+    std::vector<ViewTable> vs( 10 );
+    std::vector<std::string> titles;
+    for ( size_t i = 0; i < vs.size(); ++i )
+        titles.push_back( "title #" + std::to_string( i ) );
+    for ( size_t i = 1; i < vs.size(); ++i )
+        vs[i].title = titles[i];
+    bool res = ViewTable::insert( vs );
+    ASSERT_TRUE( res );
+
+    vsqlite::ResultSet<ViewTable> results = ViewTable::fetch();
+    ASSERT_EQ( vs.size(), results.size() );
+    ASSERT_TRUE( results[0].title.isNull() );
+    for ( size_t i = 1; i < results.size(); ++i )
+        ASSERT_EQ( results[i].title, titles[i] );
+    // All the values should have been stored in a single chunk
+    ASSERT_EQ( 1u, results.arena().nbChunks() );
+
+    size_t i = 0;
+    for ( const auto& v : ViewTable::fetch().cursor() )
+    {
+        if ( i > 0 )
+        {
+            ASSERT_EQ( v.title, titles[i] );
+        }
+        ++i;
+    }
+    ASSERT_EQ( vs.size(), i );
+
+    // Plain vectors have no arena for the views to point to
+    std::vector<ViewTable> rejected = ViewTable::fetch();
+    ASSERT_TRUE( rejected.empty() );
+    ViewTable single = ViewTable::fetch().where( ViewTable::primaryKey() == results[1].id );
+    ASSERT_TRUE( single.title.isNull() );
+    // Unless no TextView column gets loaded
+    std::vector<ViewTable> ids = ViewTable::fetch( &ViewTable::id );
+    ASSERT_EQ( vs.size(), ids.size() );
+}
+
 TEST_F( Sqlite, LoadByPrimaryKey )
 {
     TestTable ts[10];
@@ -195,15 +366,327 @@ TEST_F( Sqlite, LoadByColumnValue )
         bool res = t.insert();
         ASSERT_TRUE( res );
     }
+    std::vector<std::string> scans;
+    conn->queryPlanChecker().enable( [&scans]( const vsqlite::QueryPlanChecker::Scan& s ) {
+        scans.push_back( s.table );
+    } );
     auto attribute = TestTable::schema->column( "otherField" );
     ASSERT_TRUE( (bool)attribute ); // check for non-null shared ptr
     std::vector<TestTable> res = TestTable::fetch().where( *attribute == "test5" );
     ASSERT_EQ( 1u, res.size() );
+    // otherField is indexed
+    ASSERT_TRUE( scans.empty() );
+    conn->queryPlanChecker().disable();
     TestTable t = res[0];
     ASSERT_EQ( 6, t.id ); // We index our values from 0 but autoincrement starts from 1
     ASSERT_EQ( t.someText, "load5" );
 }
 
+TEST_F( Sqlite, QueryPlanChecker )
+{
+    std::vector<vsqlite::QueryPlanChecker::Scan> scans;
+    conn->queryPlanChecker().enable( [&scans]( const vsqlite::QueryPlanChecker::Scan& s ) {
+        scans.push_back( s );
+    }, 2 );
+    TestTable t;
+    t.someText = "scanned";
+    bool res = t.insert();
+    ASSERT_TRUE( res );
+
+    auto attribute = TestTable::schema->column( "text" );
+    std::vector<TestTable> ts = TestTable::fetch().where( *attribute == "scanned" );
+    // Small tables are fine
+    ASSERT_TRUE( scans.empty() );
+    TestTable t2;
+    res = t2.insert();
+    ASSERT_TRUE( res );
+    ts = TestTable::fetch().where( *attribute != "scanned" );
+    ASSERT_EQ( 1u, scans.size() );
+    ASSERT_EQ( "TestTable", scans[0].table );
+    ASSERT_EQ( 2, scans[0].nbRows );
+    ASSERT_EQ( "SELECT id,text,otherField,foreignKey FROM TestTable WHERE text != ?", scans[0].request );
+    // Each request is only checked once
+    ts = TestTable::fetch().where( *attribute != "scanned" );
+    ASSERT_EQ( 1u, scans.size() );
+    ts = TestTable::fetch().where( TestTable::primaryKey() == t.id );
+    ASSERT_EQ( 1u, scans.size() );
+    conn->queryPlanChecker().disable();
+}
+
+TEST_F( Sqlite, Indexes )
+{
+    auto db = vsqlite::DBConnection::instance().rawConnection();
+    sqlite3_stmt* stmt;
+    auto res = sqlite3_prepare_v2( db, "SELECT name FROM sqlite_master WHERE type = 'index' "
+                                   "AND tbl_name = 'TestTable' ORDER BY name", -1, &stmt, NULL );
+    ASSERT_EQ( SQLITE_OK, res );
+    std::vector<std::string> indexes;
+    while ( sqlite3_step( stmt ) == SQLITE_ROW )
+        indexes.push_back( (const char*)sqlite3_column_text( stmt, 0 ) );
+    sqlite3_finalize( stmt );
+    ASSERT_EQ( 2u, indexes.size() );
+    ASSERT_EQ( "TestTable_foreignKey_idx", indexes[0] );
+    ASSERT_EQ( "TestTable_otherField_idx", indexes[1] );
+}
+
+TEST_F( Sqlite, Projection )
+{
+    TestTable t;
+    t.someText = "projected";
+    t.moreText = "not loaded";
+    bool res = t.insert();
+    ASSERT_TRUE( res );
+
+    std::vector<TestTable> ts = TestTable::fetch( &TestTable::someText, &TestTable::id );
+    ASSERT_EQ( 1u, ts.size() );
+    ASSERT_EQ( t.id, ts[0].id );
+    ASSERT_EQ( ts[0].someText, "projected" );
+    ASSERT_TRUE( ts[0].moreText.isNull() );
+
+    TestTable t2 = TestTable::fetch().select( &TestTable::moreText )
+                            .where( TestTable::primaryKey() == t.id );
+    ASSERT_TRUE( t2.id.isNull() );
+    ASSERT_EQ( t2.moreText, "not loaded" );
+}
+
+TEST_F( Sqlite, Paging )
+{
+    std::vector<TestTable> ts( 10 );
+    for ( size_t i = 0; i < ts.size(); ++i )
+        ts[i].someText = "page" + std::to_string( i % 3 );
+    bool res = TestTable::insert( ts );
+    ASSERT_TRUE( res );
+
+    std::vector<TestTable> page = TestTable::fetch().orderBy( &TestTable::id, vsqlite::SortOrder::Descending )
+                                        .limit( 3 ).offset( 2 );
+    ASSERT_EQ( 3u, page.size() );
+    ASSERT_EQ( 8, page[0].id );
+    ASSERT_EQ( 6, page[2].id );
+
+    // Walk through all the rows, sorted by text then by primary key
+    std::vector<int> ids;
+    TestTable last;
+    for ( int i = 0; i < 4; ++i )
+    {
+        auto op = TestTable::fetch().orderBy( &TestTable::someText ).limit( 3 );
+        if ( i > 0 )
+            op.after( last );
+        page = std::move( op );
+        ASSERT_EQ( i < 3 ? 3u : 1u, page.size() );
+        for ( const auto& t : page )
+            ids.push_back( t.id );
+        last = page.back();
+    }
+    std::vector<int> expected = { 1, 4, 7, 10, 2, 5, 8, 3, 6, 9 };
+    ASSERT_EQ( expected, ids );
+
+    // Mixed sorting orders
+    TestTable t5 = ts[4];
+    page = TestTable::fetch().orderBy( &TestTable::someText, vsqlite::SortOrder::Descending )
+                .orderBy( TestTable::primaryKey() ).after( t5 );
+    ASSERT_EQ( 5u, page.size() );
+    ASSERT_EQ( 8, page[0].id );
+    ASSERT_EQ( 10, page[4].id );
+}
+
+TEST_F( Sqlite, Aggregates )
+{
+    ASSERT_EQ( 0, TestTable::fetch().count() );
+    ASSERT_FALSE( TestTable::fetch().exists() );
+    ASSERT_TRUE( TestTable::fetch().max( &TestTable::id ).isNull() );
+
+    std::vector<TestTable> ts( 10 );
+    for ( size_t i = 0; i < ts.size(); ++i )
+        ts[i].someText = "aggregate" + std::to_string( i % 2 );
+    bool res = TestTable::insert( ts );
+    ASSERT_TRUE( res );
+
+    ASSERT_EQ( 10, TestTable::fetch().count() );
+    auto attribute = TestTable::schema->column( "text" );
+    ASSERT_EQ( 5, TestTable::fetch().where( *attribute == "aggregate1" ).count() );
+    ASSERT_TRUE( TestTable::fetch().where( *attribute == "aggregate0" ).exists() );
+    ASSERT_FALSE( TestTable::fetch().where( *attribute == "aggregate2" ).exists() );
+    ASSERT_EQ( 1, TestTable::fetch().min( &TestTable::id ) );
+    ASSERT_EQ( 10, TestTable::fetch().max( &TestTable::id ) );
+    ASSERT_EQ( "aggregate1", (const std::string&)TestTable::fetch().max( &TestTable::someText ) );
+    ASSERT_EQ( 55, TestTable::fetch().sum( &TestTable::id ) );
+    ASSERT_EQ( 5.5, TestTable::fetch().avg( &TestTable::id ) );
+    // Only the rows of the page are aggregated
+    ASSERT_EQ( 3, TestTable::fetch().limit( 3 ).count() );
+    ASSERT_EQ( 27, TestTable::fetch().orderBy( &TestTable::id, vsqlite::SortOrder::Descending )
+                                    .limit( 3 ).sum( &TestTable::id ) );
+}
+
+TEST_F( Sqlite, UpdateAndDelete )
+{
+    std::vector<TestTable> ts( 4 );
+    for ( size_t i = 0; i < ts.size(); ++i )
+    {
+        ts[i].someText = "update" + std::to_string( i );
+        ts[i].moreText = "unchanged";
+    }
+    bool res = TestTable::insert( ts );
+    ASSERT_TRUE( res );
+    ASSERT_FALSE( ts[0].someText.isDirty() );
+
+    // Only modified columns are written
+    TestTable t = TestTable::fetch().where( TestTable::primaryKey() == ts[0].id );
+    ASSERT_FALSE( t.someText.isDirty() );
+    t.someText = "saved";
+    ASSERT_TRUE( t.someText.isDirty() );
+    res = TestTable::update().set( &TestTable::moreText, "changed behind" )
+            .where( TestTable::primaryKey() == t.id );
+    ASSERT_TRUE( res );
+    res = t.save();
+    ASSERT_TRUE( res );
+    ASSERT_FALSE( t.someText.isDirty() );
+    TestTable t2 = TestTable::fetch().where( TestTable::primaryKey() == t.id );
+    ASSERT_EQ( t2.someText, "saved" );
+    ASSERT_EQ( t2.moreText, "changed behind" );
+
+    TestTable notInserted;
+    notInserted.someText = "nope";
+    res = notInserted.save();
+    ASSERT_FALSE( res );
+
+    auto attribute = TestTable::schema->column( "otherField" );
+    res = TestTable::update().set( *attribute, "bulk" ).where( TestTable::primaryKey() > 2 );
+    ASSERT_TRUE( res );
+    ASSERT_EQ( 2, TestTable::fetch().where( *attribute == "bulk" ).count() );
+
+    res = TestTable::remove().where( *attribute == "bulk" );
+    ASSERT_TRUE( res );
+    ASSERT_EQ( 2, TestTable::fetch().count() );
+    res = TestTable::remove();
+    ASSERT_TRUE( res );
+    ASSERT_FALSE( TestTable::fetch().exists() );
+}
+
+TEST_F( Sqlite, Upsert )
+{
+    std::vector<ForeignTable> fts( 3 );
+    fts[0].value = "artist #0";
+    fts[1].value = "artist #1";
+    fts[2].value = "artist #0";
+    bool res = ForeignTable::findOrCreate( fts, &ForeignTable::value );
+    ASSERT_TRUE( res );
+    ASSERT_EQ( 1, fts[0].id );
+    ASSERT_EQ( 2, fts[1].id );
+    ASSERT_EQ( 1, fts[2].id );
+    ASSERT_EQ( 2, ForeignTable::fetch().count() );
+
+    ForeignTable ft;
+    ft.value = "artist #1";
+    res = ForeignTable::findOrCreate( ft, &ForeignTable::value );
+    ASSERT_TRUE( res );
+    ASSERT_EQ( 2, ft.id );
+
+    TestTable t;
+    t.someText = "before";
+    res = t.insert();
+    ASSERT_TRUE( res );
+    t.moreText = "kept";
+    res = t.save();
+    ASSERT_TRUE( res );
+    TestTable t2;
+    t2.id = t.id;
+    t2.someText = "after";
+    res = TestTable::upsert( t2, &TestTable::id ).update( &TestTable::someText );
+    ASSERT_TRUE( res );
+    ASSERT_EQ( 1, TestTable::fetch().count() );
+    TestTable t3 = TestTable::fetch().where( TestTable::primaryKey() == t.id );
+    ASSERT_EQ( t3.someText, "after" );
+    // The columns which weren't named are left untouched
+    ASSERT_EQ( t3.moreText, "kept" );
+
+    // Without a restriction, the whole record gets written
+    ForeignTable rescan;
+    rescan.value = "artist #1";
+    res = ForeignTable::upsert( rescan, &ForeignTable::value );
+    ASSERT_TRUE( res );
+    ASSERT_EQ( 2, rescan.id );
+    TestTable t4;
+    t4.id = t.id;
+    t4.someText = "rewritten";
+    res = TestTable::upsert( t4, &TestTable::id );
+    ASSERT_TRUE( res );
+    TestTable t5 = TestTable::fetch().where( TestTable::primaryKey() == t.id );
+    ASSERT_EQ( t5.someText, "rewritten" );
+    ASSERT_TRUE( t5.moreText.isNull() );
+}
+
+TEST_F( Sqlite, Traits )
+{
+    const int64_t bigId = ( int64_t( 1 ) << 40 ) + 1;
+    MediaTable m;
+    m.id = bigId;
+    m.rating = 4.5;
+    m.thumbnail = std::vector<uint8_t>{ 0, 1, 2, 0, 255 };
+    bool res = m.insert();
+    ASSERT_TRUE( res );
+    ASSERT_EQ( bigId, m.id );
+
+    // The next generated key doesn't get truncated either
+    MediaTable m2;
+    res = m2.insert();
+    ASSERT_TRUE( res );
+    ASSERT_EQ( bigId + 1, m2.id );
+
+    // An empty blob isn't NULL
+    m2.thumbnail = std::vector<uint8_t>();
+    res = m2.save();
+    ASSERT_TRUE( res );
+    MediaTable empty = MediaTable::fetch().where( MediaTable::primaryKey() == bigId + 1 );
+    ASSERT_FALSE( empty.thumbnail.isNull() );
+    ASSERT_TRUE( ( (const std::vector<uint8_t>&)empty.thumbnail ).empty() );
+
+    MediaTable m3 = MediaTable::fetch().where( MediaTable::primaryKey() == bigId );
+    ASSERT_EQ( bigId, m3.id );
+    ASSERT_EQ( 4.5, m3.rating );
+    ASSERT_EQ( m.thumbnail, (const std::vector<uint8_t>&)m3.thumbnail );
+    std::vector<MediaTable> ms = MediaTable::fetch().where( *MediaTable::schema->column( "thumbnail" ) ==
+                                                           std::vector<uint8_t>{ 0, 1, 2, 0, 255 } );
+    ASSERT_EQ( 1u, ms.size() );
+    ASSERT_EQ( 4.5, MediaTable::fetch().max( &MediaTable::rating ) );
+}
+
+TEST_F( Sqlite, Predicates )
+{
+    std::vector<TestTable> ts( 10 );
+    for ( size_t i = 0; i < ts.size(); ++i )
+    {
+        ts[i].someText = "load" + std::to_string( i );
+        if ( i % 2 == 0 )
+            ts[i].moreText = "test" + std::to_string( i );
+    }
+    bool res = TestTable::insert( ts );
+    ASSERT_TRUE( res );
+
+    const auto& id = TestTable::primaryKey();
+    const auto& text = *TestTable::schema->column( "text" );
+    const auto& otherField = *TestTable::schema->column( "otherField" );
+
+    std::vector<TestTable> t2s = TestTable::fetch().where( id > 3 && id <= 6 );
+    ASSERT_EQ( 3u, t2s.size() );
+    ASSERT_EQ( 4, t2s[0].id );
+    t2s = TestTable::fetch().where( id.between( 2, 4 ) );
+    ASSERT_EQ( 3u, t2s.size() );
+    t2s = TestTable::fetch().where( id.in( { 1, 5, 9, 42 } ) );
+    ASSERT_EQ( 3u, t2s.size() );
+    t2s = TestTable::fetch().where( id != 1 );
+    ASSERT_EQ( 9u, t2s.size() );
+    t2s = TestTable::fetch().where( text.like( "%5" ) );
+    ASSERT_EQ( 1u, t2s.size() );
+    ASSERT_EQ( t2s[0].someText, "load5" );
+    t2s = TestTable::fetch().where( id == 1 || text == "load9" );
+    ASSERT_EQ( 2u, t2s.size() );
+    ASSERT_EQ( 10, t2s[1].id );
+    t2s = TestTable::fetch().where( otherField.isNull() && !( id >= 8 ) );
+    ASSERT_EQ( 3u, t2s.size() );
+    t2s = TestTable::fetch().where( id < ts[2].id );
+    ASSERT_EQ( 2u, t2s.size() );
+}
+
 TEST_F( Sqlite, ForeignKey )
 {
     ForeignTable ft;
@@ -221,6 +704,426 @@ TEST_F( Sqlite, ForeignKey )
     ASSERT_EQ( ft.value, t2.foreignValue->value );
 }
 
+TEST_F( Sqlite, PrefetchForeignKey )
+{
+    std::vector<ForeignTable> fts( 3 );
+    for ( size_t i = 0; i < fts.size(); ++i )
+        fts[i].value = "foreign #" + std::to_string( i );
+    bool res = ForeignTable::insert( fts );
+    ASSERT_TRUE( res );
+    std::vector<TestTable> ts( 15 );
+    for ( size_t i = 0; i < ts.size(); ++i )
+        ts[i].foreignValue = fts[i % fts.size()];
+    // One row without any foreign value
+    ts.emplace_back();
+    res = TestTable::insert( ts );
+    ASSERT_TRUE( res );
+
+    const auto& cache = conn->statementCache();
+    auto nbRequests = cache.hits() + cache.misses();
+    std::vector<TestTable> t2s = TestTable::fetch().with( &TestTable::foreignValue );
+    ASSERT_EQ( ts.size(), t2s.size() );
+    // The rows, and then all their foreign values at once
+    ASSERT_EQ( nbRequests + 2, cache.hits() + cache.misses() );
+    for ( size_t i = 0; i + 1 < t2s.size(); ++i )
+        ASSERT_EQ( fts[i % fts.size()].value, t2s[i].foreignValue->value );
+    ASSERT_TRUE( t2s.back().foreignValue.foreignKey().isNull() );
+    ASSERT_EQ( nbRequests + 2, cache.hits() + cache.misses() );
+}
+
+TEST_F( Sqlite, IdentityMap )
+{
+    ForeignTable ft;
+    ft.value = "shared";
+    bool res = ft.insert();
+    ASSERT_TRUE( res );
+    std::vector<TestTable> ts( 10 );
+    for ( auto& t : ts )
+        t.foreignValue = ft;
+    res = TestTable::insert( ts );
+    ASSERT_TRUE( res );
+
+    const auto& cache = conn->statementCache();
+    auto nbRequests = cache.hits() + cache.misses();
+    std::vector<TestTable> t2s = TestTable::fetch();
+    const ForeignTable* shared = t2s[0].foreignValue.operator->();
+    for ( auto& t : t2s )
+    {
+        // All rows share the same instance, which was only fetched once
+        ASSERT_EQ( shared, t.foreignValue.operator->() );
+        ASSERT_EQ( ft.value, t.foreignValue->value );
+    }
+    ASSERT_EQ( nbRequests + 2, cache.hits() + cache.misses() );
+    ASSERT_EQ( 1u, conn->identityMap().size() );
+
+    vsqlite::DBConnection::invalidateCachedRow( ForeignTable::schema, ft.id );
+    ASSERT_EQ( 0u, conn->identityMap().size() );
+    // Rows which already loaded the value keep it
+    ASSERT_EQ( ft.value, t2s[0].foreignValue->value );
+}
+
+TEST_F( Sqlite, StatementCache )
+{
+    TestTable t;
+    t.someText = "cached";
+    bool res = t.insert();
+    ASSERT_TRUE( res );
+
+    const auto& cache = conn->statementCache();
+    auto hits = cache.hits();
+    auto misses = cache.misses();
+    for ( int i = 0; i < 10; ++i )
+    {
+        TestTable t2 = TestTable::fetch().where( TestTable::primaryKey() == t.id );
+        ASSERT_EQ( t.id, t2.id );
+        ASSERT_EQ( t.someText, t2.someText );
+    }
+    // Only the first fetch should have prepared the request
+    ASSERT_EQ( misses + 1, cache.misses() );
+    ASSERT_EQ( hits + 9, cache.hits() );
+}
+
+TEST_F( Sqlite, ConnectionPool )
+{
+    vsqlite::DBConnection::close();
+    bool res = vsqlite::ConnectionPool::init( "test.db", 2 );
+    ASSERT_TRUE( res );
+    auto& pool = vsqlite::ConnectionPool::instance();
+    ASSERT_EQ( 2u, pool.nbReaders() );
+    ASSERT_EQ( conn, &pool.writer() );
+
+    // Writes go through the default connection
+    TestTable t;
+    t.someText = "pooled";
+    res = t.insert();
+    ASSERT_TRUE( res );
+
+    vsqlite::DBConnection* readers[2] = { nullptr, nullptr };
+    bool stable[2] = { false, false };
+    std::string values[2];
+    for ( int i = 0; i < 2; ++i )
+    {
+        std::thread thread( [&readers, &stable, &values, &t, i]() {
+            auto& reader = vsqlite::ConnectionPool::instance().reader();
+            readers[i] = &reader;
+            // A thread keeps using the same reader
+            stable[i] = &reader == &vsqlite::ConnectionPool::instance().reader();
+            TestTable t2 = TestTable::fetch().on( reader )
+                                .where( TestTable::primaryKey() == t.id );
+            values[i] = t2.someText;
+        } );
+        thread.join();
+    }
+    ASSERT_TRUE( stable[0] );
+    ASSERT_TRUE( stable[1] );
+    ASSERT_NE( nullptr, readers[0] );
+    ASSERT_NE( nullptr, readers[1] );
+    ASSERT_NE( readers[0], readers[1] );
+    ASSERT_NE( conn, readers[0] );
+    ASSERT_EQ( t.someText, values[0] );
+    ASSERT_EQ( t.someText, values[1] );
+
+    // Foreign rows are resolved on the reader the row came from
+    ForeignTable ft;
+    ft.value = "pooled foreign";
+    res = ft.insert();
+    ASSERT_TRUE( res );
+    t.foreignValue = ft;
+    res = t.save();
+    ASSERT_TRUE( res );
+    conn->identityMap().clear();
+    TestTable t4 = TestTable::fetch().on( *readers[0] ).where( TestTable::primaryKey() == t.id );
+    ASSERT_EQ( ft.value, t4.foreignValue->value );
+    ASSERT_EQ( 1u, readers[0]->identityMap().size() );
+    ASSERT_EQ( 0u, conn->identityMap().size() );
+
+    // Readers can't write
+    TestTable t3;
+    res = t3.insert().on( *readers[0] );
+    ASSERT_FALSE( res );
+
+    vsqlite::ConnectionPool::close();
+}
+
+TEST_F( Sqlite, Profiling )
+{
+    auto& profiler = conn->profiler();
+    std::vector<std::string> slowQueries;
+    profiler.setSlowQueryCallback( [&slowQueries]( const std::string& sql, vsqlite::Profiler::Duration ) {
+        slowQueries.push_back( sql );
+    }, vsqlite::Profiler::Duration( 0 ) );
+    conn->setProfiling( true );
+
+    ForeignTable ft;
+    ft.value = "profiled";
+    bool res = ft.insert();
+    ASSERT_TRUE( res );
+    std::vector<TestTable> ts( 3 );
+    for ( auto& t : ts )
+        t.foreignValue = ft;
+    res = TestTable::insert( ts );
+    ASSERT_TRUE( res );
+    for ( int i = 0; i < 2; ++i )
+    {
+        std::vector<TestTable> fetched = TestTable::fetch();
+        ASSERT_EQ( 3u, fetched.size() );
+    }
+    // Lazily loaded, then shared through the identity map
+    TestTable t = TestTable::fetch().where( TestTable::primaryKey() == ts[0].id );
+    ASSERT_EQ( t.foreignValue->value, "profiled" );
+
+    ASSERT_EQ( 1u, profiler.foreignKeyLoads() );
+    auto rows = profiler.rowsLoaded();
+    ASSERT_EQ( 7u, rows["TestTable"] );
+    ASSERT_EQ( 1u, rows["ForeignTable"] );
+    ASSERT_LE( 5u, profiler.prepares() );
+    ASSERT_LE( 7u, profiler.steps() );
+
+    auto statements = profiler.snapshot();
+    auto it = std::find_if( statements.begin(), statements.end(), []( const vsqlite::Profiler::StatementProfile& p ) {
+        return p.sql == "SELECT id,text,otherField,foreignKey FROM TestTable";
+    } );
+    ASSERT_TRUE( it != statements.end() );
+    ASSERT_EQ( 2u, it->count );
+    ASSERT_LE( it->p99.count(), it->total.count() );
+    ASSERT_LT( 0, it->total.count() );
+    // Parameters are expanded for slow queries
+    ASSERT_TRUE( std::find( slowQueries.begin(), slowQueries.end(),
+                            "SELECT id,text,otherField,foreignKey FROM TestTable WHERE id == " + std::to_string( ts[0].id ) ) != slowQueries.end() );
+
+    conn->setProfiling( false );
+    profiler.reset();
+    std::vector<TestTable> fetched = TestTable::fetch();
+    ASSERT_TRUE( profiler.snapshot().empty() );
+    ASSERT_EQ( 0u, profiler.prepares() );
+}
+
+static std::string pragma( vsqlite::DBConnection& c, const char* name )
+{
+    sqlite3_stmt* stmt;
+    std::string request = std::string( "PRAGMA " ) + name;
+    sqlite3_prepare_v2( c.rawConnection(), request.c_str(), -1, &stmt, NULL );
+    std::string res;
+    if ( sqlite3_step( stmt ) == SQLITE_ROW )
+        res = (const char*)sqlite3_column_text( stmt, 0 );
+    sqlite3_finalize( stmt );
+    return res;
+}
+
+TEST_F( Sqlite, ConnectionOptions )
+{
+    vsqlite::DBConnection::close();
+    unlink( "test.db" );
+    auto options = vsqlite::ConnectionOptions::readHeavy();
+    options.pageSize = 8192;
+    bool res = vsqlite::DBConnection::init( "test.db", options );
+    ASSERT_TRUE( res );
+    ASSERT_EQ( "wal", pragma( *conn, "journal_mode" ) );
+    ASSERT_EQ( "1", pragma( *conn, "synchronous" ) );
+    ASSERT_EQ( "2", pragma( *conn, "temp_store" ) );
+    ASSERT_EQ( "8192", pragma( *conn, "page_size" ) );
+    ASSERT_EQ( "-65536", pragma( *conn, "cache_size" ) );
+    ASSERT_NE( "0", pragma( *conn, "mmap_size" ) );
+
+    // Switching profiles around an import
+    res = conn->configure( vsqlite::ConnectionOptions::bulkLoad() );
+    ASSERT_TRUE( res );
+    ASSERT_EQ( "0", pragma( *conn, "synchronous" ) );
+    std::vector<TestTable> ts( 10 );
+    res = TestTable::insert( ts );
+    ASSERT_TRUE( res );
+    res = conn->configure( vsqlite::ConnectionOptions::durable() );
+    ASSERT_TRUE( res );
+    ASSERT_EQ( "2", pragma( *conn, "synchronous" ) );
+    ASSERT_EQ( 10, TestTable::fetch().count() );
+
+    vsqlite::ConnectionOptions invalid;
+    invalid.journalMode = "NOT A MODE;";
+    res = conn->configure( invalid );
+    ASSERT_FALSE( res );
+    // Unknown modes are ignored by SQLite, which keeps the current one
+    invalid.journalMode = "unknown";
+    res = conn->configure( invalid );
+    ASSERT_FALSE( res );
+    ASSERT_EQ( "wal", pragma( *conn, "journal_mode" ) );
+}
+
+static bool hasIndex( vsqlite::DBConnection& c, const std::string& name )
+{
+    sqlite3_stmt* stmt;
+    std::string req = "SELECT 1 FROM sqlite_master WHERE type = 'index' AND name = '" + name + "'";
+    sqlite3_prepare_v2( c.rawConnection(), req.c_str(), -1, &stmt, NULL );
+    bool res = sqlite3_step( stmt ) == SQLITE_ROW;
+    sqlite3_finalize( stmt );
+    return res;
+}
+
+TEST_F( Sqlite, SchemaVersion )
+{
+    ASSERT_EQ( 1, MediaTable::schema->version() );
+    ASSERT_NE( "0", pragma( *conn, "user_version" ) );
+    sqlite3_exec( conn->rawConnection(), "DROP INDEX TestTable_otherField_idx", NULL, NULL, NULL );
+
+    // The schema didn't change, so no DDL runs when reopening
+    vsqlite::DBConnection::close();
+    bool res = vsqlite::DBConnection::init( "test.db" );
+    ASSERT_TRUE( res );
+    ASSERT_FALSE( hasIndex( *conn, "TestTable_otherField_idx" ) );
+
+    sqlite3_exec( conn->rawConnection(), "PRAGMA user_version = 0", NULL, NULL, NULL );
+    vsqlite::DBConnection::close();
+    res = vsqlite::DBConnection::init( "test.db" );
+    ASSERT_TRUE( res );
+    ASSERT_TRUE( hasIndex( *conn, "TestTable_otherField_idx" ) );
+    // An index which can't be created fails the whole schema update, so
+    // that it gets retried next time
+    int code = sqlite3_exec( conn->rawConnection(), "DROP INDEX ForeignTable_value_unique_idx;"
+                             "INSERT INTO ForeignTable VALUES(NULL, 'twice'), (NULL, 'twice');"
+                             "PRAGMA user_version = 0", NULL, NULL, NULL );
+    ASSERT_EQ( SQLITE_OK, code );
+    vsqlite::DBConnection::close();
+    res = vsqlite::DBConnection::init( "test.db" );
+    ASSERT_FALSE( res );
+    sqlite3* db;
+    sqlite3_open( "test.db", &db );
+    code = sqlite3_exec( db, "DELETE FROM ForeignTable", NULL, NULL, NULL );
+    sqlite3_close( db );
+    ASSERT_EQ( SQLITE_OK, code );
+    res = vsqlite::DBConnection::init( "test.db" );
+    ASSERT_TRUE( res );
+    ASSERT_TRUE( hasIndex( *conn, "ForeignTable_value_unique_idx" ) );
+}
+
+TEST_F( Sqlite, SchemaDrift )
+{
+    // The database is more recent than the declaration
+    int code = sqlite3_exec( conn->rawConnection(), "UPDATE vsqlite_schema SET version = 5 WHERE name = 'MediaTable';"
+                             "PRAGMA user_version = 0", NULL, NULL, NULL );
+    ASSERT_EQ( SQLITE_OK, code );
+    vsqlite::DBConnection::close();
+    bool res = vsqlite::DBConnection::init( "test.db" );
+    ASSERT_FALSE( res );
+
+    // The declaration changed, but its version didn't
+    sqlite3* db;
+    sqlite3_open( "test.db", &db );
+    code = sqlite3_exec( db, "UPDATE vsqlite_schema SET version = 1 WHERE name = 'MediaTable';"
+                         "UPDATE vsqlite_schema SET hash = 0 WHERE name = 'TestTable'", NULL, NULL, NULL );
+    sqlite3_close( db );
+    ASSERT_EQ( SQLITE_OK, code );
+    res = vsqlite::DBConnection::init( "test.db" );
+    ASSERT_FALSE( res );
+}
+
+TEST_F( Sqlite, Migration )
+{
+    // Simulate a database created before the rating column was added
+    int res = sqlite3_exec( conn->rawConnection(), "ALTER TABLE MediaTable DROP COLUMN rating;"
+                            "UPDATE vsqlite_schema SET version = 0 WHERE name = 'MediaTable';"
+                            "PRAGMA user_version = 0", NULL, NULL, NULL );
+    ASSERT_EQ( SQLITE_OK, res );
+    vsqlite::DBConnection::close();
+    bool success = vsqlite::DBConnection::init( "test.db" );
+    ASSERT_TRUE( success );
+
+    MediaTable m;
+    m.rating = 3.5;
+    success = m.insert();
+    ASSERT_TRUE( success );
+    ASSERT_EQ( 3.5, MediaTable::fetch().max( &MediaTable::rating ) );
+    sqlite3_stmt* stmt;
+    sqlite3_prepare_v2( conn->rawConnection(), "SELECT version FROM vsqlite_schema WHERE name = 'MediaTable'",
+                        -1, &stmt, NULL );
+    ASSERT_EQ( SQLITE_ROW, sqlite3_step( stmt ) );
+    ASSERT_EQ( 1, sqlite3_column_int( stmt, 0 ) );
+    sqlite3_finalize( stmt );
+}
+
+static int countOnDisk( const std::string& table )
+{
+    sqlite3* db;
+    sqlite3_open_v2( "test.db", &db, SQLITE_OPEN_READONLY, NULL );
+    sqlite3_stmt* stmt;
+    int res = -1;
+    std::string req = "SELECT COUNT(*) FROM " + table;
+    if ( sqlite3_prepare_v2( db, req.c_str(), -1, &stmt, NULL ) == SQLITE_OK )
+    {
+        if ( sqlite3_step( stmt ) == SQLITE_ROW )
+            res = sqlite3_column_int( stmt, 0 );
+        sqlite3_finalize( stmt );
+    }
+    sqlite3_close( db );
+    return res;
+}
+
+TEST_F( Sqlite, InMemory )
+{
+    TestTable t;
+    bool res = t.insert();
+    ASSERT_TRUE( res );
+    vsqlite::DBConnection::close();
+
+    // The profiles' journal mode doesn't apply to in-memory databases
+    res = vsqlite::DBConnection::initInMemory( "test.db", vsqlite::ConnectionOptions::bulkLoad() );
+    ASSERT_TRUE( res );
+    ASSERT_TRUE( conn->isInMemory() );
+    ASSERT_EQ( "memory", pragma( *conn, "journal_mode" ) );
+    ASSERT_EQ( "0", pragma( *conn, "synchronous" ) );
+    // Loaded from the snapshot
+    ASSERT_EQ( 1, TestTable::fetch().count() );
+    std::vector<TestTable> ts( 10 );
+    res = TestTable::insert( ts );
+    ASSERT_TRUE( res );
+    ASSERT_EQ( 1, countOnDisk( "TestTable" ) );
+    res = conn->flush( 1 );
+    ASSERT_TRUE( res );
+    ASSERT_EQ( 11, countOnDisk( "TestTable" ) );
+
+    conn->setAutoFlush( std::chrono::milliseconds( 10 ) );
+    res = TestTable::remove().where( TestTable::primaryKey() == t.id );
+    ASSERT_TRUE( res );
+    for ( int i = 0; i < 100 && countOnDisk( "TestTable" ) != 10; ++i )
+        std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+    ASSERT_EQ( 10, countOnDisk( "TestTable" ) );
+    conn->setAutoFlush( std::chrono::milliseconds( 0 ) );
+
+    // Uncommitted rows never reach the snapshot, even with the timer running
+    conn->setAutoFlush( std::chrono::milliseconds( 1 ) );
+    {
+        auto transaction = conn->newTransaction();
+        TestTable uncommitted;
+        res = uncommitted.insert();
+        ASSERT_TRUE( res );
+        res = conn->flush();
+        ASSERT_FALSE( res );
+        std::this_thread::sleep_for( std::chrono::milliseconds( 20 ) );
+        ASSERT_EQ( 10, countOnDisk( "TestTable" ) );
+        transaction.rollback();
+    }
+    conn->setAutoFlush( std::chrono::milliseconds( 0 ) );
+    res = conn->flush();
+    ASSERT_TRUE( res );
+    ASSERT_EQ( 10, countOnDisk( "TestTable" ) );
+
+    // Closing flushes the pending changes
+    std::vector<TestTable> more( 10 );
+    res = TestTable::insert( more );
+    ASSERT_TRUE( res );
+    res = vsqlite::DBConnection::close();
+    ASSERT_TRUE( res );
+    ASSERT_EQ( 20, countOnDisk( "TestTable" ) );
+
+    // The pool's readers wouldn't see the in-memory database
+    res = vsqlite::ConnectionPool::init( "test.db", 1 );
+    ASSERT_TRUE( res );
+    res = vsqlite::DBConnection::initInMemory( "test.db" );
+    ASSERT_FALSE( res );
+    vsqlite::ConnectionPool::close();
+
+    res = vsqlite::DBConnection::init( "test.db" );
+    ASSERT_TRUE( res );
+}
+
 int main( int argc, char **argv )
 {
   ::testing::InitGoogleTest(&argc, argv);